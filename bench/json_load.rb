@@ -0,0 +1,59 @@
+# Compares Report.parse_json against the previous recursive key rewrite on a
+# synthetic JSON profile.
+#
+#   $ ruby bench/json_load.rb [frames] [edges per frame]
+$:.unshift File.expand_path('../lib', __dir__)
+require 'stackprof'
+require 'benchmark'
+require 'json'
+require 'tmpdir'
+
+frames_count = Integer(ARGV[0] || 200_000)
+edges_count = Integer(ARGV[1] || 8)
+
+def legacy_parse_json(json)
+  json.keys.each do |key|
+    value = json.delete(key)
+    legacy_parse_json(value) if value.is_a?(Hash)
+
+    new_key = case key
+    when /\A[0-9]*\z/
+      key.to_i
+    else
+      key.to_sym
+    end
+
+    json[new_key] = value
+  end
+  json
+end
+
+def measure(label)
+  GC.start
+  allocated = GC.stat(:total_allocated_objects)
+  result = nil
+  time = Benchmark.realtime { result = yield }
+  printf "%-7s %8.3fs %12d objects\n", label, time, GC.stat(:total_allocated_objects) - allocated
+  result
+end
+
+random = Random.new(1)
+ids = Array.new(frames_count) { random.rand(1 << 47) }
+frames = ids.each_with_index.to_h do |id, i|
+  edges = Array.new(edges_count) { [ids[random.rand(frames_count)], random.rand(100)] }.to_h
+  lines = Array.new(edges_count) { [random.rand(1000), [random.rand(100), random.rand(100)]] }.to_h
+  [id, { name: "Foo#bar#{i}", file: "/app/foo/#{i % 500}.rb", line: i % 1000, total_samples: 100, samples: 10, edges: edges, lines: lines }]
+end
+profile = { version: 1.2, mode: :cpu, interval: 1000, samples: 100, gc_samples: 0, missed_samples: 0, metadata: { "app" => "bench" }, frames: frames }
+
+Dir.mktmpdir do |dir|
+  path = File.join(dir, "profile.json")
+  File.write(path, JSON.generate(profile))
+  printf "%d frames, %.1f MB\n", frames_count, File.size(path) / 1024.0 / 1024
+  source = File.read(path)
+
+  measure("parse") { JSON.parse(source) }
+  legacy = measure("legacy") { legacy_parse_json(JSON.parse(source)) }
+  current = measure("current") { StackProf::Report.parse_json(JSON.parse(source)) }
+  abort "results differ" unless current == legacy
+end
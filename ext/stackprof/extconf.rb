@@ -5,6 +5,20 @@ if RUBY_ENGINE == 'truffleruby'
   return
 end
 
+have_func('rb_str_to_interned_str')
+if have_func('rb_gc_mark_movable')
+  have_func('rb_st_foreach_with_replace', 'ruby/st.h')
+end
+have_library('dl', 'dladdr', 'dlfcn.h')
+have_func('dladdr', 'dlfcn.h')
+have_header('linux/perf_event.h')
+if have_header('zlib.h') && have_library('z', 'compress2', 'zlib.h')
+  have_func('compress2', 'zlib.h')
+end
+if have_func('rb_internal_thread_add_event_hook', 'ruby/thread.h')
+  have_struct_member('rb_internal_thread_event_data_t', 'thread', 'ruby/thread.h')
+end
+
 if (have_func('rb_postponed_job_preregister') ||
     have_func('rb_postponed_job_register_one')) &&
    have_func('rb_profile_frames') &&
@@ -13,18 +13,62 @@
 #include <ruby/io.h>
 #include <ruby/intern.h>
 #include <ruby/vm.h>
+#include <ruby/thread.h>
 #include <signal.h>
 #include <sys/time.h>
 #include <time.h>
 #include <pthread.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#if defined(HAVE_ZLIB_H) && defined(HAVE_COMPRESS2)
+#define STACKPROF_SPILL_COMPRESS 1
+#include <zlib.h>
+#else
+#define STACKPROF_SPILL_COMPRESS 0
+#endif
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/* Native stacks are walked through frame pointers, from the registers the
+ * signal handler is given. */
+#if defined(HAVE_DLADDR) && (defined(__x86_64__) || defined(__aarch64__)) && (defined(__linux__) || defined(__APPLE__))
+#define STACKPROF_NATIVE_STACKS 1
+#include <dlfcn.h>
+#ifdef __APPLE__
+#include <sys/ucontext.h>
+#else
+#include <ucontext.h>
+#endif
+#else
+#define STACKPROF_NATIVE_STACKS 0
+#endif
 
 #define BUF_SIZE 2048
+#define NATIVE_BUF_SIZE 64
+#define REPEAT_BUF_SIZE 64
+
+/* A run of this many native frames inside the Ruby VM marks the point where
+ * the native stack goes back from extension or library code into the
+ * interpreter. */
+#define NATIVE_VM_RUN 3
 #define MICROSECONDS_IN_SECOND 1000000
 #define NANOSECONDS_IN_SECOND 1000000000
 
 #define FAKE_FRAME_GC    INT2FIX(0)
 #define FAKE_FRAME_MARK  INT2FIX(1)
 #define FAKE_FRAME_SWEEP INT2FIX(2)
+#define FAKE_FRAME_GVL_WAIT INT2FIX(3)
+#define FAKE_FRAME_BLOCKED  INT2FIX(4)
+#define FAKE_FRAME_TRUNCATED INT2FIX(5)
+
+/* Longest cycle of frames that fold_recursion collapses. */
+#define FOLD_MAX_CYCLE 4
 
 #ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
 static rb_postponed_job_handle_t job_record_gc, job_sample_and_record, job_record_buffer;
@@ -40,6 +84,19 @@ static const char *fake_frame_cstrs[] = {
 	"(garbage collection)",
 	"(marking)",
 	"(sweeping)",
+	"(waiting for GVL)",
+	"(blocked)",
+	"(truncated)",
+};
+
+/* State of the profiled thread in wall mode, as reported by the thread event
+ * hooks: holding the GVL, waiting to acquire it, or having released it
+ * (blocking IO, sleep, or a C extension running without the GVL). */
+enum thread_state {
+    THREAD_STATE_RUNNING,
+    THREAD_STATE_GVL_WAIT,
+    THREAD_STATE_BLOCKED,
+    TOTAL_THREAD_STATES
 };
 
 static int stackprof_use_postponed_job = 1;
@@ -94,13 +151,99 @@ typedef struct {
     size_t seen_at_sample_number;
     st_table *edges;
     st_table *lines;
+    st_table *metrics;		/* metric id -> frame_metric_t, see StackProf.sample */
 } frame_data_t;
 
+/* The weights a frame was given under one metric, in the same columns as
+ * the sample counts of frame_data_t. */
+typedef struct {
+    size_t total;
+    size_t self;
+    st_table *edges;
+    st_table *lines;
+    st_table *self_lines;
+} frame_metric_t;
+
 typedef struct {
     uint64_t timestamp_usec;
     int64_t delta_usec;
 } sample_time_t;
 
+/* Weight of a sample taken with StackProf.sample(weight, metric:), metric
+ * being the id of the metric plus one (0 for an unweighted sample). */
+typedef struct {
+    int metric;
+    size_t weight;
+} sample_weight_t;
+
+typedef struct {
+    VALUE name;
+    VALUE file;
+    VALUE line;
+    unsigned int generation;	/* of the last results call that used it */
+} frame_info_t;
+
+/* A native function seen in a sample. Native frames are recorded as fixnum
+ * frames numbered after the fake frames (TOTAL_FAKE_FRAMES + index). */
+typedef struct {
+    const void *addr;		/* symbol address, or the pc if there is no symbol */
+    const char *symbol;
+    const char *object;		/* path of the shared object containing it */
+    const void *base;		/* load address of that object */
+    int in_vm;
+} native_frame_t;
+
+/* Raw samples spilled to disk while profiling, see stackprof_spill_chunk.
+ * The buffers are handed over to the writer thread, which frees them. */
+typedef struct spill_chunk {
+    struct spill_chunk *next;
+    uint64_t *raw;
+    size_t raw_len;
+    sample_time_t *times;
+    size_t times_len;
+    int *label_sets;		/* NULL if none of the samples were labeled */
+    sample_weight_t *weights;	/* NULL if none of the samples were weighted */
+} spill_chunk_t;
+
+/* Each chunk is written as this header followed by the raw words, the
+ * times, the label sets (if SPILL_LABEL_SETS) and the weights (if
+ * SPILL_WEIGHTS), deflated if SPILL_COMPRESSED. */
+typedef struct {
+    char magic[4];
+    uint32_t flags;
+    uint64_t raw_len;
+    uint64_t times_len;
+    uint64_t size;		/* uncompressed payload */
+    uint64_t stored_size;
+} spill_header_t;
+
+#define SPILL_MAGIC "SPR1"
+#define SPILL_COMPRESSED 1
+#define SPILL_LABEL_SETS 2
+#define SPILL_WEIGHTS 4
+#define SPILL_DEFAULT_CHUNK 65536
+
+/* Symbolized frames are kept across start/stop cycles, but only those the
+ * latest `results` call reported: the others are evicted then, so frames of
+ * unloaded or re-evaluated code can be collected. A single profile with
+ * more frames than this doesn't keep any. */
+#define FRAME_INFO_CACHE_MAX 16384
+
+/* Frames are moved by GC compaction (Ruby 2.7+) rather than pinned. */
+#if defined(HAVE_RB_GC_MARK_MOVABLE) && defined(HAVE_RB_ST_FOREACH_WITH_REPLACE)
+# define STACKPROF_GC_COMPACT 1
+#else
+# define STACKPROF_GC_COMPACT 0
+# undef rb_gc_mark_movable
+# define rb_gc_mark_movable(obj) rb_gc_mark(obj)
+#endif
+
+#ifdef HAVE_RB_STR_TO_INTERNED_STR
+# define intern_str(str) rb_str_to_interned_str(str)
+#else
+# define intern_str(str) rb_obj_freeze(str)
+#endif
+
 /* We need to ensure that various memory operations are visible across
  * threads.  Ruby doesn't offer a portable way to do this sort of detection
  * across all the Ruby versions we support, so we use something that casts a
@@ -123,6 +266,28 @@ static struct {
     VALUE out;
     VALUE metadata;
     int ignore_gc;
+    int thread_states;
+    int native;
+    int max_depth;
+    int fold_recursion;
+    int fork_continue;
+    int forked;			/* a child that kept profiling, see stackprof_atfork_child */
+    int fork_pending;		/* a child not resumed by StackProf._fork_continue yet */
+    VALUE event;
+    int perf_fd;
+    int perf_user_only;		/* task_clock without kernel time, see stackprof_perf_open */
+
+    VALUE spill_path;
+    size_t spill_chunk;
+    int spill_fd;
+    int spill_errno;
+    size_t spilled_chunks;
+    int spill_writer_started;
+    int spill_writer_done;
+    pthread_t spill_writer;
+    pthread_mutex_t spill_lock;
+    pthread_cond_t spill_cond;
+    spill_chunk_t *spill_head, *spill_tail;
 
     uint64_t *raw_samples;
     size_t raw_samples_len;
@@ -133,6 +298,21 @@ static struct {
     sample_time_t *raw_sample_times;
     size_t raw_sample_times_len;
     size_t raw_sample_times_capa;
+    int *raw_sample_label_sets;
+    sample_weight_t *raw_sample_weights;
+
+    VALUE metrics;		/* metric names, by id */
+    VALUE metric_ids;
+    int sample_metric;		/* of the sample being recorded, as in sample_weight_t */
+    size_t sample_weight;
+
+    /* Label sets are numbered as samples with them are recorded, and
+     * forgotten by `results`. 0 is "no labels". */
+    VALUE label_sets;		/* by id */
+    st_table *label_set_ids;	/* label set -> id, by identity */
+    VALUE label_set_cache;	/* label set -> itself, see StackProf.with_labels */
+    st_table *label_samples;
+    VALUE sample_labels;
 
     size_t overall_signals;
     size_t overall_samples;
@@ -141,6 +321,9 @@ static struct {
     size_t unrecorded_gc_marking_samples;
     size_t unrecorded_gc_sweeping_samples;
     st_table *frames;
+    st_table *frame_info_cache;
+    unsigned int frame_info_generation;
+    int frames_moved;		/* frame tables need rehashing, see stackprof_gc_compact */
 
     timestamp_t gc_start_timestamp;
 
@@ -149,10 +332,36 @@ static struct {
 
     int buffer_count;
     sample_time_t buffer_time;
-    VALUE frames_buffer[BUF_SIZE];
-    int lines_buffer[BUF_SIZE];
+    int buffer_thread_state;
+    VALUE buffer_labels;
+    size_t buffer_gvl_generation;
+    size_t buffer_repeats;
+    uint64_t buffer_repeat_times[REPEAT_BUF_SIZE]; /* when each repeat was taken, in raw mode */
+    /* Native frames spliced into a sample go in front of its Ruby frames,
+     * hence the extra room. */
+    VALUE frames_buffer[BUF_SIZE + NATIVE_BUF_SIZE];
+    int lines_buffer[BUF_SIZE + NATIVE_BUF_SIZE];
+
+    void *native_buffer[NATIVE_BUF_SIZE];
+    int native_buffer_count;
+    st_table *native_frame_ids;	/* pc -> index into native_frames */
+    st_table *native_symbol_ids;	/* symbol address -> index into native_frames */
+    native_frame_t *native_frames;
+    size_t native_frames_len;
+    size_t native_frames_capa;
+    const void *vm_object_base;
+    uintptr_t native_stack_lo;	/* bounds of the target thread's stack */
+    uintptr_t native_stack_hi;
 
     pthread_t target_thread;
+    VALUE target_rb_thread;
+    int target_thread_state;
+    int sampled_thread_state;
+    size_t gvl_generation;
+    size_t thread_state_samples[TOTAL_THREAD_STATES];
+#ifdef HAVE_RB_INTERNAL_THREAD_ADD_EVENT_HOOK
+    rb_internal_thread_event_hook_t *thread_hook;
+#endif
 } _stackprof;
 
 #if STACKPROF_HAVE_ATOMICS
@@ -161,25 +370,560 @@ static struct {
 #define STACKPROF_RUNNING() _stackprof.running
 #endif
 
+/* The initial-exec model keeps the variable in static TLS, so reading it from
+ * the signal handler never has to allocate. */
+#if defined(__GNUC__)
+#define STACKPROF_THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+#else
+#define STACKPROF_THREAD_LOCAL
+#endif
+
+/* The frozen label set that samples taken on this thread are attributed to,
+ * or 0. Labels belong to a fiber: StackProf.with_labels keeps them in the
+ * fiber's locals, which also keeps them alive, and the fiber switch hook
+ * copies the resumed fiber's labels here, where the signal handler can
+ * read them. */
+static STACKPROF_THREAD_LOCAL VALUE current_labels;
+static ID id_labels;
+
 static VALUE sym_object, sym_wall, sym_cpu, sym_custom, sym_name, sym_file, sym_line;
 static VALUE sym_samples, sym_total_samples, sym_missed_samples, sym_edges, sym_lines;
 static VALUE sym_version, sym_mode, sym_interval, sym_raw, sym_raw_lines, sym_metadata, sym_frames, sym_ignore_gc, sym_out;
 static VALUE sym_aggregate, sym_raw_sample_timestamps, sym_raw_timestamp_deltas, sym_state, sym_marking, sym_sweeping;
 static VALUE sym_gc_samples, objtracer;
+static VALUE sym_thread_states, sym_running, sym_gvl_wait, sym_blocked;
+static VALUE sym_label_sets, sym_label_samples, sym_raw_sample_label_sets;
+static VALUE sym_metric, sym_metrics, sym_weight, sym_raw_sample_weights;
+static VALUE sym_spill, sym_spill_chunk, sym_max_depth, sym_fold_recursion;
+static VALUE sym_fork, sym_continue, sym_stop;
+static VALUE sym_native, sym_perf, sym_event, sym_task_clock, sym_page_faults, sym_context_switches, sym_cpu_migrations;
 static VALUE gc_hook;
 static VALUE rb_mStackProf;
 
 static void stackprof_newobj_handler(VALUE, void*);
 static void stackprof_signal_handler(int sig, siginfo_t* sinfo, void* ucontext);
+#if STACKPROF_GC_COMPACT
+static void stackprof_rehash_frames(void);
+#else
+#define stackprof_rehash_frames() ((void)0)
+#endif
+
+#if STACKPROF_HAVE_ATOMICS
+#define TARGET_THREAD_STATE() __atomic_load_n(&_stackprof.target_thread_state, __ATOMIC_ACQUIRE)
+#define SET_TARGET_THREAD_STATE(state) __atomic_store_n(&_stackprof.target_thread_state, (state), __ATOMIC_RELEASE)
+#else
+#define TARGET_THREAD_STATE() _stackprof.target_thread_state
+#define SET_TARGET_THREAD_STATE(state) (_stackprof.target_thread_state = (state))
+#endif
+
+#ifdef HAVE_RB_INTERNAL_THREAD_ADD_EVENT_HOOK
+static void
+stackprof_thread_event_hook(rb_event_flag_t event, const rb_internal_thread_event_data_t *event_data, void *data)
+{
+#ifdef HAVE_RB_INTERNAL_THREAD_EVENT_DATA_T_THREAD
+    if (event_data->thread != _stackprof.target_rb_thread) return;
+#else
+    /* Before Ruby 3.3 the hook doesn't say which thread it is about, but it
+     * runs on the native thread of the Ruby thread changing state. */
+    if (!pthread_equal(pthread_self(), _stackprof.target_thread)) return;
+#endif
+
+    switch (event) {
+      case RUBY_INTERNAL_THREAD_EVENT_READY:
+	SET_TARGET_THREAD_STATE(THREAD_STATE_GVL_WAIT);
+	break;
+      case RUBY_INTERNAL_THREAD_EVENT_RESUMED:
+#if STACKPROF_HAVE_ATOMICS
+	__atomic_add_fetch(&_stackprof.gvl_generation, 1, __ATOMIC_RELEASE);
+#else
+	_stackprof.gvl_generation++;
+#endif
+	SET_TARGET_THREAD_STATE(THREAD_STATE_RUNNING);
+	break;
+      case RUBY_INTERNAL_THREAD_EVENT_SUSPENDED:
+	SET_TARGET_THREAD_STATE(THREAD_STATE_BLOCKED);
+	break;
+    }
+}
+#endif
+
+#if STACKPROF_NATIVE_STACKS
+/* Called on the thread to be sampled. */
+static void
+stackprof_native_init(void)
+{
+    Dl_info info;
+#ifdef __APPLE__
+    pthread_t self = pthread_self();
+
+    _stackprof.native_stack_hi = (uintptr_t)pthread_get_stackaddr_np(self);
+    _stackprof.native_stack_lo = _stackprof.native_stack_hi - pthread_get_stacksize_np(self);
+#else
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+
+    _stackprof.native_stack_lo = _stackprof.native_stack_hi = 0;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+	if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+	    _stackprof.native_stack_lo = (uintptr_t)addr;
+	    _stackprof.native_stack_hi = (uintptr_t)addr + size;
+	}
+	pthread_attr_destroy(&attr);
+    }
+#endif
+
+    if (_stackprof.native_frame_ids)
+	return;
+
+    if (dladdr((void *)rb_profile_frames, &info))
+	_stackprof.vm_object_base = info.dli_fbase;
+
+    _stackprof.native_frame_ids = st_init_numtable();
+    _stackprof.native_symbol_ids = st_init_numtable();
+}
+
+/* Follows the frame pointer chain of the interrupted code, starting from
+ * the registers saved in `ucontext`. Unlike backtrace(), this takes no
+ * locks and loads nothing, so it can run in the signal handler. A frame
+ * pointer is only read if it lies within the target thread's stack, above
+ * the previous one, so a broken chain (code built without frame pointers,
+ * a fiber's stack) ends the walk instead of faulting; the frames below it
+ * are lost. */
+static int
+stackprof_native_walk(void *ucontext, void **pcs, int max)
+{
+    const ucontext_t *uc = ucontext;
+    uintptr_t pc, fp, next;
+    int n = 0;
+
+#if defined(__APPLE__) && defined(__x86_64__)
+    pc = uc->uc_mcontext->__ss.__rip;
+    fp = uc->uc_mcontext->__ss.__rbp;
+#elif defined(__APPLE__)
+    pc = uc->uc_mcontext->__ss.__pc;
+    fp = uc->uc_mcontext->__ss.__fp;
+#elif defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+#else
+    pc = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+#endif
+
+    pcs[n++] = (void *)pc;
+    /* a frame is [caller's frame pointer, return address] */
+    while (n < max &&
+	   fp >= _stackprof.native_stack_lo && fp <= _stackprof.native_stack_hi - 2 * sizeof(uintptr_t) &&
+	   fp % sizeof(uintptr_t) == 0) {
+	pc = ((uintptr_t *)fp)[1];
+	next = ((uintptr_t *)fp)[0];
+	if (!pc)
+	    break;
+	pcs[n++] = (void *)pc;
+	if (next <= fp)
+	    break;
+	fp = next;
+    }
+
+    return n;
+}
+
+static size_t
+native_frame_index(const void *pc)
+{
+    st_data_t val;
+    Dl_info info;
+    const void *addr;
+    native_frame_t *frame;
+
+    if (st_lookup(_stackprof.native_frame_ids, (st_data_t)pc, &val))
+	return (size_t)val;
+
+    MEMZERO(&info, Dl_info, 1);
+    dladdr(pc, &info);
+    addr = info.dli_saddr ? info.dli_saddr : pc;
+
+    if (!st_lookup(_stackprof.native_symbol_ids, (st_data_t)addr, &val)) {
+	if (_stackprof.native_frames_len == _stackprof.native_frames_capa) {
+	    _stackprof.native_frames_capa = _stackprof.native_frames_capa ? _stackprof.native_frames_capa * 2 : 64;
+	    REALLOC_N(_stackprof.native_frames, native_frame_t, _stackprof.native_frames_capa);
+	}
+	frame = &_stackprof.native_frames[_stackprof.native_frames_len];
+	frame->addr = addr;
+	frame->symbol = info.dli_saddr ? info.dli_sname : NULL;
+	frame->object = info.dli_fname;
+	frame->base = info.dli_fbase;
+	frame->in_vm = info.dli_fbase && info.dli_fbase == _stackprof.vm_object_base;
+
+	val = (st_data_t)_stackprof.native_frames_len++;
+	st_insert(_stackprof.native_symbol_ids, (st_data_t)addr, val);
+    }
+    st_insert(_stackprof.native_frame_ids, (st_data_t)pc, val);
+
+    return (size_t)val;
+}
+
+/* Splices the native frames captured by the signal handler in front of the
+ * Ruby frames of the buffered sample, returning the new frame count. Only the
+ * frames between the interrupted instruction and the point where the native
+ * stack goes back into the VM are kept, i.e. the extension or library code
+ * running under the topmost (cfunc) Ruby frame, or just the interrupted
+ * function if the frame pointers don't lead back there. A thread state
+ * frame, if any, stays on top. */
+static int
+stackprof_splice_native_frames(int num)
+{
+    VALUE native[NATIVE_BUF_SIZE];
+    int i, k = 0, vm_run = 0, at = 0, outside_vm = 0, vm_return = -1;
+    int count = _stackprof.native_buffer_count;
+    void **pcs = _stackprof.native_buffer;
+
+    _stackprof.native_buffer_count = 0;
+
+    for (i = 0; i < count; i++) {
+	/* return addresses point after the call; look up the call itself */
+	size_t idx = native_frame_index(i == 0 ? pcs[i] : (char *)pcs[i] - 1);
+
+	if (_stackprof.native_frames[idx].in_vm) {
+	    if (outside_vm && vm_return < 0)
+		vm_return = k;
+	    if (++vm_run == NATIVE_VM_RUN)
+		break;
+	} else {
+	    vm_run = 0;
+	    outside_vm = 1;
+	}
+	native[k++] = INT2FIX(TOTAL_FAKE_FRAMES + idx);
+    }
+
+    if (vm_run < NATIVE_VM_RUN) {
+	/* The chain broke (the VM and most distribution libraries are built
+	 * without frame pointers). Frames up to a return into the VM were
+	 * chained properly; otherwise only the interrupted function is
+	 * certain. */
+	if (vm_return >= 0)
+	    k = vm_return + 1;
+	else if (k > 0 && !_stackprof.native_frames[FIX2INT(native[0]) - TOTAL_FAKE_FRAMES].in_vm)
+	    k = 1;
+	else
+	    return num;
+    } else {
+	k -= vm_run - 1;
+	if (k <= 0)
+	    return num;
+    }
+
+    if (num > 0 && (_stackprof.frames_buffer[0] == FAKE_FRAME_GVL_WAIT || _stackprof.frames_buffer[0] == FAKE_FRAME_BLOCKED))
+	at = 1;
+
+    MEMMOVE(_stackprof.frames_buffer + at + k, _stackprof.frames_buffer + at, VALUE, num - at);
+    MEMMOVE(_stackprof.lines_buffer + at + k, _stackprof.lines_buffer + at, int, num - at);
+    for (i = 0; i < k; i++) {
+	_stackprof.frames_buffer[at + i] = native[i];
+	_stackprof.lines_buffer[at + i] = 0;
+    }
+
+    return num + k;
+}
+#endif
+
+static int
+spill_write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+	ssize_t n = write(fd, p, len);
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    return -1;
+	}
+	p += n;
+	len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int
+spill_write_chunk(int fd, spill_chunk_t *chunk)
+{
+    spill_header_t header;
+    size_t raw_size = chunk->raw_len * sizeof(uint64_t);
+    size_t times_size = chunk->times_len * sizeof(sample_time_t);
+    size_t labels_size = chunk->label_sets ? chunk->times_len * sizeof(int) : 0;
+    size_t weights_size = chunk->weights ? chunk->times_len * sizeof(sample_weight_t) : 0;
+    char *payload, *stored;
+    int ret;
+
+    memcpy(header.magic, SPILL_MAGIC, 4);
+    header.flags = (chunk->label_sets ? SPILL_LABEL_SETS : 0) | (chunk->weights ? SPILL_WEIGHTS : 0);
+    header.raw_len = chunk->raw_len;
+    header.times_len = chunk->times_len;
+    header.size = raw_size + times_size + labels_size + weights_size;
+
+    payload = malloc(header.size);
+    if (!payload) return ENOMEM;
+    memcpy(payload, chunk->raw, raw_size);
+    memcpy(payload + raw_size, chunk->times, times_size);
+    if (labels_size)
+	memcpy(payload + raw_size + times_size, chunk->label_sets, labels_size);
+    if (weights_size)
+	memcpy(payload + raw_size + times_size + labels_size, chunk->weights, weights_size);
+
+    stored = payload;
+    header.stored_size = header.size;
+#if STACKPROF_SPILL_COMPRESS
+    {
+	uLongf stored_size = compressBound(header.size);
+	char *compressed = malloc(stored_size);
+	if (compressed && compress2((Bytef *)compressed, &stored_size, (Bytef *)payload, header.size, Z_BEST_SPEED) == Z_OK) {
+	    stored = compressed;
+	    header.stored_size = stored_size;
+	    header.flags |= SPILL_COMPRESSED;
+	} else {
+	    free(compressed);
+	}
+    }
+#endif
+
+    ret = spill_write_all(fd, &header, sizeof(header)) || spill_write_all(fd, stored, header.stored_size) ? errno : 0;
+    if (stored != payload) free(stored);
+    free(payload);
+    return ret;
+}
+
+static void
+spill_chunk_free(spill_chunk_t *chunk)
+{
+    free(chunk->raw);
+    free(chunk->times);
+    free(chunk->label_sets);
+    free(chunk->weights);
+    free(chunk);
+}
+
+/* Runs without the GVL and never touches Ruby objects. After a write
+ * error the remaining chunks are dropped; results reports the error. */
+static void *
+stackprof_spill_writer(void *arg)
+{
+    spill_chunk_t *chunk;
+
+    pthread_mutex_lock(&_stackprof.spill_lock);
+    for (;;) {
+	while (!_stackprof.spill_head && !_stackprof.spill_writer_done)
+	    pthread_cond_wait(&_stackprof.spill_cond, &_stackprof.spill_lock);
+	if (!(chunk = _stackprof.spill_head))
+	    break;
+	_stackprof.spill_head = chunk->next;
+	if (!_stackprof.spill_head)
+	    _stackprof.spill_tail = NULL;
+	pthread_mutex_unlock(&_stackprof.spill_lock);
+
+	if (!_stackprof.spill_errno)
+	    _stackprof.spill_errno = spill_write_chunk(_stackprof.spill_fd, chunk);
+	spill_chunk_free(chunk);
+
+	pthread_mutex_lock(&_stackprof.spill_lock);
+    }
+    pthread_mutex_unlock(&_stackprof.spill_lock);
+
+    return NULL;
+}
+
+/* Hands the raw buffers over to the writer thread, starting it (and
+ * creating the file) the first time. Called from the recording path once
+ * the buffers hold spill_chunk samples, so their size stays bounded however
+ * long the capture runs. If the file can't be created, samples stay in
+ * memory. */
+static void
+stackprof_spill_chunk(void)
+{
+    spill_chunk_t *chunk;
+
+    if (!_stackprof.spill_writer_started) {
+	_stackprof.spill_fd = open(RSTRING_PTR(_stackprof.spill_path), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (_stackprof.spill_fd < 0) {
+	    _stackprof.spill_errno = errno;
+	    _stackprof.spill_path = Qnil;
+	    return;
+	}
+	_stackprof.spill_writer_done = 0;
+	if ((errno = pthread_create(&_stackprof.spill_writer, NULL, stackprof_spill_writer, NULL))) {
+	    _stackprof.spill_errno = errno;
+	    close(_stackprof.spill_fd);
+	    _stackprof.spill_fd = -1;
+	    _stackprof.spill_path = Qnil;
+	    return;
+	}
+	_stackprof.spill_writer_started = 1;
+    }
+
+    chunk = malloc(sizeof(spill_chunk_t));
+    if (!chunk) return;
+    chunk->next = NULL;
+    chunk->raw = _stackprof.raw_samples;
+    chunk->raw_len = _stackprof.raw_samples_len;
+    chunk->times = _stackprof.raw_sample_times;
+    chunk->times_len = _stackprof.raw_sample_times_len;
+    chunk->label_sets = _stackprof.raw_sample_label_sets;
+    chunk->weights = _stackprof.raw_sample_weights;
+
+    _stackprof.raw_samples = NULL;
+    _stackprof.raw_samples_len = 0;
+    _stackprof.raw_samples_capa = 0;
+    _stackprof.raw_sample_index = 0;
+    _stackprof.raw_sample_times = NULL;
+    _stackprof.raw_sample_times_len = 0;
+    _stackprof.raw_sample_times_capa = 0;
+    _stackprof.raw_sample_label_sets = NULL;
+    _stackprof.raw_sample_weights = NULL;
+
+    pthread_mutex_lock(&_stackprof.spill_lock);
+    if (_stackprof.spill_tail)
+	_stackprof.spill_tail->next = chunk;
+    else
+	_stackprof.spill_head = chunk;
+    _stackprof.spill_tail = chunk;
+    pthread_cond_signal(&_stackprof.spill_cond);
+    pthread_mutex_unlock(&_stackprof.spill_lock);
+
+    _stackprof.spilled_chunks++;
+}
+
+static void *
+spill_join_writer(void *arg)
+{
+    pthread_join(_stackprof.spill_writer, NULL);
+    return NULL;
+}
+
+/* Waits for the writer to drain its queue and exit. */
+static void
+stackprof_spill_finish(void)
+{
+    if (!_stackprof.spill_writer_started)
+	return;
+
+    pthread_mutex_lock(&_stackprof.spill_lock);
+    _stackprof.spill_writer_done = 1;
+    pthread_cond_signal(&_stackprof.spill_cond);
+    pthread_mutex_unlock(&_stackprof.spill_lock);
+
+    rb_thread_call_without_gvl(spill_join_writer, NULL, NULL, NULL);
+    _stackprof.spill_writer_started = 0;
+
+    close(_stackprof.spill_fd);
+    _stackprof.spill_fd = -1;
+}
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+/* Describes the software counter for `event`, sampling every `period`. */
+static void
+stackprof_perf_attr(struct perf_event_attr *attr, VALUE event, unsigned long period)
+{
+    MEMZERO(attr, struct perf_event_attr, 1);
+    attr->size = sizeof(*attr);
+    attr->type = PERF_TYPE_SOFTWARE;
+    attr->disabled = 1;
+    attr->exclude_hv = 1;
+
+    if (event == sym_task_clock) {
+	attr->config = PERF_COUNT_SW_TASK_CLOCK;
+	period *= 1000; /* counted in nanoseconds */
+    } else if (event == sym_page_faults) {
+	attr->config = PERF_COUNT_SW_PAGE_FAULTS;
+    } else if (event == sym_context_switches) {
+	attr->config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+    } else if (event == sym_cpu_migrations) {
+	attr->config = PERF_COUNT_SW_CPU_MIGRATIONS;
+    } else {
+	rb_raise(rb_eArgError, "unknown perf event: %"PRIsVALUE, rb_inspect(event));
+    }
+    attr->sample_period = period;
+
+    /* Page faults happen in userspace, so they can be counted without access
+     * to kernel events (perf_event_paranoid 2). Task clock counts time in
+     * the kernel too, like ITIMER_PROF does, and scheduler events are only
+     * seen from the kernel side. */
+    if (attr->config == PERF_COUNT_SW_PAGE_FAULTS || _stackprof.perf_user_only)
+	attr->exclude_kernel = 1;
+}
+
+/* Opens the counter on the calling thread, delivering SIGPROF to it. Only
+ * sets errno on failure: a forked child reopens its counter where it can't
+ * raise. */
+static int
+stackprof_perf_fd(struct perf_event_attr *attr)
+{
+    struct f_owner_ex owner;
+    int fd, e;
+
+    fd = (int)syscall(SYS_perf_event_open, attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0)
+	return -1;
+
+    owner.type = F_OWNER_TID;
+    owner.pid = (pid_t)syscall(SYS_gettid);
+    if (fcntl(fd, F_SETFL, O_ASYNC | O_NONBLOCK) < 0 ||
+	fcntl(fd, F_SETSIG, SIGPROF) < 0 ||
+	fcntl(fd, F_SETOWN_EX, &owner) < 0) {
+	e = errno;
+	close(fd);
+	errno = e;
+	return -1;
+    }
+
+    return fd;
+}
+
+/* Opens a software counter on the calling thread that raises SIGPROF on it
+ * every `period` events. Only the sampled thread is counted, and the signal
+ * is delivered to it rather than to an arbitrary thread. */
+static int
+stackprof_perf_open(VALUE event, unsigned long period)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    _stackprof.perf_user_only = 0;
+    stackprof_perf_attr(&attr, event, period);
+    fd = stackprof_perf_fd(&attr);
+    if (fd < 0 && (errno == EACCES || errno == EPERM) && event == sym_task_clock) {
+	/* kernel time isn't visible under perf_event_paranoid 2: count the
+	 * time spent in userspace only */
+	_stackprof.perf_user_only = 1;
+	stackprof_perf_attr(&attr, event, period);
+	fd = stackprof_perf_fd(&attr);
+    }
+    if (fd < 0) {
+	if (errno == EACCES || errno == EPERM) {
+	    int paranoid = -1;
+	    FILE *f = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+	    if (f) {
+		if (fscanf(f, "%d", &paranoid) != 1) paranoid = -1;
+		fclose(f);
+	    }
+	    rb_raise(rb_eRuntimeError,
+		     "perf_event_open is not permitted for the %"PRIsVALUE" event (kernel.perf_event_paranoid is %d); "
+		     "lower it or grant CAP_PERFMON to use perf mode", rb_sym2str(event), paranoid);
+	}
+	rb_sys_fail("perf_event_open");
+    }
+
+    return fd;
+}
+#endif
 
 static VALUE
 stackprof_start(int argc, VALUE *argv, VALUE self)
 {
     struct sigaction sa;
     struct itimerval timer;
-    VALUE opts = Qnil, mode = Qnil, interval = Qnil, metadata = rb_hash_new(), out = Qfalse;
+    VALUE opts = Qnil, mode = Qnil, interval = Qnil, metadata = rb_hash_new(), out = Qfalse, event = Qnil;
+    VALUE spill = Qnil, spill_chunk = Qnil, on_fork = Qnil;
     int ignore_gc = 0;
-    int raw = 0, aggregate = 1;
+    int raw = 0, aggregate = 1, thread_states = 0, native = 0, max_depth = 0, fold_recursion = 0;
     VALUE metadata_val;
 
     if (STACKPROF_RUNNING())
@@ -207,10 +951,69 @@ stackprof_start(int argc, VALUE *argv, VALUE self)
 	    raw = 1;
 	if (rb_hash_lookup2(opts, sym_aggregate, Qundef) == Qfalse)
 	    aggregate = 0;
+	if (RTEST(rb_hash_aref(opts, sym_thread_states)))
+	    thread_states = 1;
+	if (RTEST(rb_hash_aref(opts, sym_native)))
+	    native = 1;
+	event = rb_hash_aref(opts, sym_event);
+	if (RTEST(rb_hash_aref(opts, sym_max_depth))) {
+	    max_depth = NUM2INT(rb_hash_aref(opts, sym_max_depth));
+	    if (max_depth < 1 || max_depth > BUF_SIZE - 2)
+		rb_raise(rb_eArgError, "max_depth is a number of frames between 1 and %d", BUF_SIZE - 2);
+	}
+	if (RTEST(rb_hash_aref(opts, sym_fold_recursion)))
+	    fold_recursion = 1;
+	spill = rb_hash_aref(opts, sym_spill);
+	spill_chunk = rb_hash_aref(opts, sym_spill_chunk);
+	on_fork = rb_hash_aref(opts, sym_fork);
     }
     if (!RTEST(mode)) mode = sym_wall;
 
-    if (!NIL_P(interval) && (NUM2INT(interval) < 1 || NUM2INT(interval) >= MICROSECONDS_IN_SECOND)) {
+    if (!NIL_P(on_fork) && on_fork != sym_stop && on_fork != sym_continue)
+	rb_raise(rb_eArgError, "fork should be :stop or :continue");
+    /* children are resumed from the Process._fork hook in stackprof.rb */
+    if (on_fork == sym_continue && !rb_respond_to(rb_mProcess, rb_intern("_fork")))
+	rb_raise(rb_eArgError, "fork: :continue requires Ruby 3.1+");
+
+    if (RTEST(event) && mode != sym_perf)
+	rb_raise(rb_eArgError, "event is only supported in perf mode");
+
+    if (thread_states) {
+#ifdef HAVE_RB_INTERNAL_THREAD_ADD_EVENT_HOOK
+	if (mode != sym_wall)
+	    rb_raise(rb_eArgError, "thread_states is only supported in wall mode");
+	/* the stack would be taken on whichever thread runs the job */
+	if (stackprof_use_postponed_job)
+	    rb_raise(rb_eArgError, "thread states can't be sampled from postponed jobs");
+#else
+	rb_raise(rb_eArgError, "thread_states requires Ruby 3.2+");
+#endif
+    }
+
+    if (native) {
+#if STACKPROF_NATIVE_STACKS
+	if (mode != sym_wall && mode != sym_cpu && mode != sym_perf)
+	    rb_raise(rb_eArgError, "native is only supported in wall, cpu and perf mode");
+	if (stackprof_use_postponed_job)
+	    rb_raise(rb_eArgError, "native stacks can't be sampled from postponed jobs");
+	stackprof_native_init();
+#else
+	rb_raise(rb_eArgError, "native stacks are not supported on this platform");
+#endif
+    }
+
+    if (RTEST(spill)) {
+	if (!raw)
+	    rb_raise(rb_eArgError, "spill requires raw: true");
+	spill = rb_str_new_frozen(FilePathValue(spill));
+	if (!NIL_P(spill_chunk) && NUM2LONG(spill_chunk) < 1)
+	    rb_raise(rb_eArgError, "spill_chunk is a number of samples greater than 0");
+    }
+
+    if (mode == sym_perf && RTEST(event) && event != sym_task_clock) {
+	if (!NIL_P(interval) && NUM2LONG(interval) < 1)
+	    rb_raise(rb_eArgError, "interval is a number of %"PRIsVALUE" events greater than 0", event);
+    } else if (!NIL_P(interval) && (NUM2INT(interval) < 1 || NUM2INT(interval) >= MICROSECONDS_IN_SECOND)) {
         rb_raise(rb_eArgError, "interval is a number of microseconds between 1 and 1 million");
     }
 
@@ -219,6 +1022,10 @@ stackprof_start(int argc, VALUE *argv, VALUE self)
 	_stackprof.overall_signals = 0;
 	_stackprof.overall_samples = 0;
 	_stackprof.during_gc = 0;
+	MEMZERO(_stackprof.thread_state_samples, size_t, TOTAL_THREAD_STATES);
+	_stackprof.label_samples = st_init_numtable();
+	rb_ary_clear(_stackprof.metrics);
+	rb_hash_clear(_stackprof.metric_ids);
     }
 
     if (mode == sym_object) {
@@ -238,6 +1045,22 @@ stackprof_start(int argc, VALUE *argv, VALUE self)
 	timer.it_interval.tv_usec = NUM2UINT(interval);
 	timer.it_value = timer.it_interval;
 	setitimer(mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+    } else if (mode == sym_perf) {
+#ifdef HAVE_LINUX_PERF_EVENT_H
+	if (!RTEST(event)) event = sym_task_clock;
+	if (!RTEST(interval)) interval = INT2FIX(event == sym_task_clock ? 1000 : 1);
+
+	_stackprof.perf_fd = stackprof_perf_open(event, NUM2ULONG(interval));
+
+	sa.sa_sigaction = stackprof_signal_handler;
+	sa.sa_flags = SA_RESTART | SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, NULL);
+
+	ioctl(_stackprof.perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+#else
+	rb_raise(rb_eArgError, "perf mode requires Linux");
+#endif
     } else if (mode == sym_custom) {
 	/* sampled manually */
 	interval = Qnil;
@@ -249,10 +1072,32 @@ stackprof_start(int argc, VALUE *argv, VALUE self)
     _stackprof.aggregate = aggregate;
     _stackprof.mode = mode;
     _stackprof.interval = interval;
+    _stackprof.event = event;
     _stackprof.ignore_gc = ignore_gc;
     _stackprof.metadata = metadata;
     _stackprof.out = out;
     _stackprof.target_thread = pthread_self();
+    _stackprof.target_rb_thread = rb_thread_current();
+    _stackprof.thread_states = thread_states;
+    _stackprof.native = native;
+    _stackprof.max_depth = max_depth;
+    _stackprof.fold_recursion = fold_recursion;
+    _stackprof.fork_continue = on_fork == sym_continue;
+    _stackprof.forked = 0;
+    _stackprof.fork_pending = 0;
+    /* a spill already in progress (profiling restarted before results)
+     * keeps its file */
+    if (RTEST(spill) && !_stackprof.spill_writer_started && !_stackprof.spilled_chunks) {
+	_stackprof.spill_path = spill;
+	_stackprof.spill_chunk = NIL_P(spill_chunk) ? SPILL_DEFAULT_CHUNK : NUM2SIZET(spill_chunk);
+    }
+    SET_TARGET_THREAD_STATE(THREAD_STATE_RUNNING);
+#ifdef HAVE_RB_INTERNAL_THREAD_ADD_EVENT_HOOK
+    if (thread_states) {
+	_stackprof.thread_hook = rb_internal_thread_add_event_hook(stackprof_thread_event_hook,
+	    RUBY_INTERNAL_THREAD_EVENT_READY | RUBY_INTERNAL_THREAD_EVENT_RESUMED | RUBY_INTERNAL_THREAD_EVENT_SUSPENDED, NULL);
+    }
+#endif
     /* We need to ensure previous initialization stores are visible across
      * threads. */
 #if STACKPROF_HAVE_ATOMICS
@@ -294,12 +1139,33 @@ stackprof_stop(VALUE self)
 	sa.sa_flags = SA_RESTART;
 	sigemptyset(&sa.sa_mask);
 	sigaction(_stackprof.mode == sym_wall ? SIGALRM : SIGPROF, &sa, NULL);
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    } else if (_stackprof.mode == sym_perf) {
+	/* -1 in a forked child, which must leave the parent's counter alone */
+	if (_stackprof.perf_fd >= 0) {
+	    ioctl(_stackprof.perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+	    close(_stackprof.perf_fd);
+	    _stackprof.perf_fd = -1;
+	}
+
+	sa.sa_handler = SIG_IGN;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, NULL);
+#endif
     } else if (_stackprof.mode == sym_custom) {
 	/* sampled manually */
     } else {
 	rb_raise(rb_eArgError, "unknown profiler mode");
     }
 
+#ifdef HAVE_RB_INTERNAL_THREAD_ADD_EVENT_HOOK
+    if (_stackprof.thread_hook) {
+	rb_internal_thread_remove_event_hook(_stackprof.thread_hook);
+	_stackprof.thread_hook = NULL;
+    }
+#endif
+
     return Qtrue;
 }
 
@@ -319,6 +1185,24 @@ frame_edges_i(st_data_t key, st_data_t val, st_data_t arg)
     return ST_CONTINUE;
 }
 
+static int
+label_sets_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    VALUE label_sets = (VALUE)arg;
+
+    rb_hash_aset(label_sets, INT2FIX(key), RARRAY_AREF(_stackprof.label_sets, (long)key));
+    return ST_CONTINUE;
+}
+
+static int
+label_samples_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    VALUE label_samples = (VALUE)arg;
+
+    rb_hash_aset(label_samples, INT2FIX(key), SIZET2NUM((size_t)val));
+    return ST_CONTINUE;
+}
+
 static int
 frame_lines_i(st_data_t key, st_data_t val, st_data_t arg)
 {
@@ -332,6 +1216,98 @@ frame_lines_i(st_data_t key, st_data_t val, st_data_t arg)
     return ST_CONTINUE;
 }
 
+static int
+metric_lines_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    VALUE lines = (VALUE)arg;
+
+    rb_hash_aset(lines, INT2FIX(key), rb_ary_new3(2, SIZET2NUM((size_t)val), INT2FIX(0)));
+    return ST_CONTINUE;
+}
+
+static int
+metric_self_lines_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    VALUE line = rb_hash_aref((VALUE)arg, INT2FIX(key));
+
+    rb_ary_store(line, 1, SIZET2NUM((size_t)val));
+    return ST_CONTINUE;
+}
+
+/* Adds the weights of a frame under a metric to its :metrics hash, with
+ * the same keys as the frame's own sample counts. */
+static int
+frame_metrics_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    VALUE metrics = (VALUE)arg;
+    frame_metric_t *metric = (frame_metric_t *)val;
+    VALUE details = rb_hash_new(), edges, lines;
+
+    rb_hash_aset(metrics, RARRAY_AREF(_stackprof.metrics, (long)key - 1), details);
+    rb_hash_aset(details, sym_total_samples, SIZET2NUM(metric->total));
+    rb_hash_aset(details, sym_samples, SIZET2NUM(metric->self));
+
+    if (metric->edges) {
+	edges = rb_hash_new();
+	rb_hash_aset(details, sym_edges, edges);
+	st_foreach(metric->edges, frame_edges_i, (st_data_t)edges);
+	st_free_table(metric->edges);
+    }
+
+    if (metric->lines) {
+	lines = rb_hash_new();
+	rb_hash_aset(details, sym_lines, lines);
+	st_foreach(metric->lines, metric_lines_i, (st_data_t)lines);
+	st_foreach(metric->self_lines, metric_self_lines_i, (st_data_t)lines);
+	st_free_table(metric->lines);
+	st_free_table(metric->self_lines);
+    }
+
+    xfree(metric);
+    return ST_DELETE;
+}
+
+static frame_info_t *
+frame_info_for(VALUE frame)
+{
+    st_data_t val = 0;
+    frame_info_t *info;
+    VALUE name, file;
+
+    if (st_lookup(_stackprof.frame_info_cache, (st_data_t)frame, &val)) {
+	info = (frame_info_t *)val;
+	info->generation = _stackprof.frame_info_generation;
+	return info;
+    }
+
+    name = rb_profile_frame_full_label(frame);
+    file = rb_profile_frame_absolute_path(frame);
+    if (NIL_P(file))
+	file = rb_profile_frame_path(frame);
+
+    info = ALLOC_N(frame_info_t, 1);
+    info->name = NIL_P(name) ? Qnil : intern_str(name);
+    info->file = NIL_P(file) ? Qnil : intern_str(file);
+    info->line = rb_profile_frame_first_lineno(frame);
+    info->generation = _stackprof.frame_info_generation;
+    st_insert(_stackprof.frame_info_cache, (st_data_t)frame, (st_data_t)info);
+
+    return info;
+}
+
+/* Evicts the entries not used by the current results call, or all of them
+ * if `arg` is set. */
+static int
+frame_info_free_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    frame_info_t *info = (frame_info_t *)val;
+
+    if (!arg && info->generation == _stackprof.frame_info_generation)
+	return ST_CONTINUE;
+    xfree(info);
+    return ST_DELETE;
+}
+
 static int
 frame_i(st_data_t key, st_data_t val, st_data_t arg)
 {
@@ -344,17 +1320,32 @@ frame_i(st_data_t key, st_data_t val, st_data_t arg)
 
     rb_hash_aset(results, PTR2NUM(frame), details);
 
-    if (FIXNUM_P(frame)) {
+    if (FIXNUM_P(frame) && (size_t)FIX2INT(frame) < TOTAL_FAKE_FRAMES) {
 	name = _stackprof.fake_frame_names[FIX2INT(frame)];
 	file = _stackprof.empty_string;
 	line = INT2FIX(0);
+#if STACKPROF_NATIVE_STACKS
+    } else if (FIXNUM_P(frame)) {
+	native_frame_t *native = &_stackprof.native_frames[FIX2INT(frame) - TOTAL_FAKE_FRAMES];
+	if (native->symbol) {
+	    name = intern_str(rb_str_new_cstr(native->symbol));
+	} else if (native->object && native->base) {
+	    /* unexported function: report its offset, as addr2line expects */
+	    const char *basename = strrchr(native->object, '/');
+	    name = rb_sprintf("%s+0x%lx", basename ? basename + 1 : native->object,
+			      (unsigned long)((const char *)native->addr - (const char *)native->base));
+	} else {
+	    name = rb_sprintf("%p", native->addr);
+	}
+	file = native->object ? intern_str(rb_str_new_cstr(native->object)) : _stackprof.empty_string;
+	line = INT2FIX(0);
+	rb_hash_aset(details, sym_native, Qtrue);
+#endif
     } else {
-	name = rb_profile_frame_full_label(frame);
-
-	file = rb_profile_frame_absolute_path(frame);
-	if (NIL_P(file))
-	    file = rb_profile_frame_path(frame);
-	line = rb_profile_frame_first_lineno(frame);
+	frame_info_t *info = frame_info_for(frame);
+	name = info->name;
+	file = info->file;
+	line = info->line;
     }
 
     rb_hash_aset(details, sym_name, name);
@@ -363,27 +1354,172 @@ frame_i(st_data_t key, st_data_t val, st_data_t arg)
 	rb_hash_aset(details, sym_line, line);
     }
 
-    rb_hash_aset(details, sym_total_samples, SIZET2NUM(frame_data->total_samples));
-    rb_hash_aset(details, sym_samples, SIZET2NUM(frame_data->caller_samples));
+    rb_hash_aset(details, sym_total_samples, SIZET2NUM(frame_data->total_samples));
+    rb_hash_aset(details, sym_samples, SIZET2NUM(frame_data->caller_samples));
+
+    if (frame_data->edges) {
+        edges = rb_hash_new();
+        rb_hash_aset(details, sym_edges, edges);
+        st_foreach(frame_data->edges, frame_edges_i, (st_data_t)edges);
+        st_free_table(frame_data->edges);
+        frame_data->edges = NULL;
+    }
+
+    if (frame_data->lines) {
+	lines = rb_hash_new();
+	rb_hash_aset(details, sym_lines, lines);
+	st_foreach(frame_data->lines, frame_lines_i, (st_data_t)lines);
+	st_free_table(frame_data->lines);
+	frame_data->lines = NULL;
+    }
+
+    if (frame_data->metrics) {
+	VALUE metrics = rb_hash_new();
+	rb_hash_aset(details, sym_metrics, metrics);
+	st_foreach(frame_data->metrics, frame_metrics_i, (st_data_t)metrics);
+	st_free_table(frame_data->metrics);
+	frame_data->metrics = NULL;
+    }
+
+    xfree(frame_data);
+    return ST_DELETE;
+}
+
+typedef struct {
+    VALUE samples;
+    VALUE lines;
+    VALUE timestamps;
+    VALUE deltas;
+    VALUE label_sets;		/* nil until a labeled sample shows up */
+    VALUE weights;		/* metric name -> weight of each sample */
+    size_t sample_count;
+} raw_results_t;
+
+/* Pads the weights of a metric with zeros up to sample +len+. */
+static VALUE
+raw_weights_fill(VALUE weights, size_t len)
+{
+    while ((size_t)RARRAY_LEN(weights) < len)
+	rb_ary_push(weights, INT2FIX(0));
+    return weights;
+}
+
+static void
+raw_results_append(raw_results_t *raw, const uint64_t *raw_samples, size_t raw_samples_len,
+		   const sample_time_t *times, size_t times_len, const int *label_sets,
+		   const sample_weight_t *weights)
+{
+    size_t len, n, o;
+
+    for (n = 0; n < raw_samples_len; n++) {
+	len = (size_t)raw_samples[n];
+	rb_ary_push(raw->samples, SIZET2NUM(len));
+	rb_ary_push(raw->lines, SIZET2NUM(len));
+
+	for (o = 0, n++; o < len; n++, o++) {
+	    // Line is in the upper 16 bits
+	    rb_ary_push(raw->lines, INT2NUM(raw_samples[n] >> 48));
+
+	    VALUE frame = raw_samples[n] & ~((uint64_t)0xFFFF << 48);
+	    rb_ary_push(raw->samples, PTR2NUM(frame));
+	}
+
+	rb_ary_push(raw->samples, SIZET2NUM((size_t)raw_samples[n]));
+	rb_ary_push(raw->lines, SIZET2NUM((size_t)raw_samples[n]));
+    }
+
+    for (n = 0; n < times_len; n++) {
+	rb_ary_push(raw->timestamps, ULL2NUM(times[n].timestamp_usec));
+	rb_ary_push(raw->deltas, LL2NUM(times[n].delta_usec));
+    }
+
+    if (label_sets && NIL_P(raw->label_sets)) {
+	raw->label_sets = rb_ary_new_capa(raw->sample_count + times_len);
+	for (n = 0; n < raw->sample_count; n++)
+	    rb_ary_push(raw->label_sets, INT2FIX(0));
+    }
+    if (!NIL_P(raw->label_sets)) {
+	for (n = 0; n < times_len; n++)
+	    rb_ary_push(raw->label_sets, INT2FIX(label_sets ? label_sets[n] : 0));
+    }
+
+    for (n = 0; weights && n < times_len; n++) {
+	VALUE name, ary;
+	if (!weights[n].metric)
+	    continue;
+	name = RARRAY_AREF(_stackprof.metrics, weights[n].metric - 1);
+	if (NIL_P(ary = rb_hash_lookup(raw->weights, name)))
+	    rb_hash_aset(raw->weights, name, ary = rb_ary_new());
+	rb_ary_push(raw_weights_fill(ary, raw->sample_count + n), SIZET2NUM(weights[n].weight));
+    }
+    raw->sample_count += times_len;
+}
 
-    if (frame_data->edges) {
-        edges = rb_hash_new();
-        rb_hash_aset(details, sym_edges, edges);
-        st_foreach(frame_data->edges, frame_edges_i, (st_data_t)edges);
-        st_free_table(frame_data->edges);
-        frame_data->edges = NULL;
+/* Reads back the chunks written by the spill writer, in order, and removes
+ * the file. A truncated or unreadable chunk ends the read. */
+static void
+stackprof_read_spill(raw_results_t *raw)
+{
+    spill_header_t header;
+    char *payload = NULL, *stored = NULL;
+    VALUE path = _stackprof.spill_path;
+    FILE *f;
+
+    stackprof_spill_finish();
+    _stackprof.spilled_chunks = 0;
+    if (NIL_P(path))
+	return;
+    if (!(f = fopen(RSTRING_PTR(path), "rb"))) {
+	rb_warn("stackprof: spilled raw samples could not be read back, results are incomplete: %s", strerror(errno));
+	return;
     }
 
-    if (frame_data->lines) {
-	lines = rb_hash_new();
-	rb_hash_aset(details, sym_lines, lines);
-	st_foreach(frame_data->lines, frame_lines_i, (st_data_t)lines);
-	st_free_table(frame_data->lines);
-	frame_data->lines = NULL;
+    while (fread(&header, sizeof(header), 1, f) == 1 && !memcmp(header.magic, SPILL_MAGIC, 4)) {
+	size_t raw_size = header.raw_len * sizeof(uint64_t);
+	size_t times_size = header.times_len * sizeof(sample_time_t);
+	size_t labels_size = header.flags & SPILL_LABEL_SETS ? header.times_len * sizeof(int) : 0;
+
+	payload = realloc(payload, header.size);
+	stored = realloc(stored, header.stored_size);
+	if ((header.size && !payload) || (header.stored_size && !stored))
+	    break;
+	if (fread(stored, 1, header.stored_size, f) != header.stored_size)
+	    break;
+
+	if (header.flags & SPILL_COMPRESSED) {
+#if STACKPROF_SPILL_COMPRESS
+	    uLongf size = header.size;
+	    if (uncompress((Bytef *)payload, &size, (Bytef *)stored, header.stored_size) != Z_OK || size != header.size)
+		break;
+#else
+	    break;
+#endif
+	} else {
+	    memcpy(payload, stored, header.size);
+	}
+
+	raw_results_append(raw, (uint64_t *)payload, header.raw_len,
+			   (sample_time_t *)(payload + raw_size), header.times_len,
+			   header.flags & SPILL_LABEL_SETS ? (int *)(payload + raw_size + times_size) : NULL,
+			   header.flags & SPILL_WEIGHTS ? (sample_weight_t *)(payload + raw_size + times_size + labels_size) : NULL);
     }
 
-    xfree(frame_data);
-    return ST_DELETE;
+    free(payload);
+    free(stored);
+    fclose(f);
+    unlink(RSTRING_PTR(path));
+}
+
+/* The output path of a forked child: its pid goes in front of the extension
+ * of the path `out:` gave the parent, tmp/stackprof.dump writing
+ * tmp/stackprof.1234.dump. */
+static VALUE
+stackprof_fork_out(VALUE out)
+{
+    VALUE ext = rb_funcall(rb_cFile, rb_intern("extname"), 1, out);
+    long len = RSTRING_LEN(out) - RSTRING_LEN(ext);
+
+    return rb_sprintf("%.*s.%ld%"PRIsVALUE, (int)len, RSTRING_PTR(out), (long)getpid(), ext);
 }
 
 static VALUE
@@ -398,42 +1534,69 @@ stackprof_results(int argc, VALUE *argv, VALUE self)
     rb_hash_aset(results, sym_version, DBL2NUM(1.2));
     rb_hash_aset(results, sym_mode, _stackprof.mode);
     rb_hash_aset(results, sym_interval, _stackprof.interval);
+    if (_stackprof.mode == sym_perf)
+	rb_hash_aset(results, sym_event, _stackprof.event);
     rb_hash_aset(results, sym_samples, SIZET2NUM(_stackprof.overall_samples));
     rb_hash_aset(results, sym_gc_samples, SIZET2NUM(_stackprof.during_gc));
     rb_hash_aset(results, sym_missed_samples, SIZET2NUM(_stackprof.overall_signals - _stackprof.overall_samples));
     rb_hash_aset(results, sym_metadata, _stackprof.metadata);
 
+    if (_stackprof.thread_states) {
+	VALUE states = rb_hash_new();
+	rb_hash_aset(states, sym_running, SIZET2NUM(_stackprof.thread_state_samples[THREAD_STATE_RUNNING]));
+	rb_hash_aset(states, sym_gvl_wait, SIZET2NUM(_stackprof.thread_state_samples[THREAD_STATE_GVL_WAIT]));
+	rb_hash_aset(states, sym_blocked, SIZET2NUM(_stackprof.thread_state_samples[THREAD_STATE_BLOCKED]));
+	rb_hash_aset(results, sym_thread_states, states);
+    }
+
     _stackprof.metadata = Qnil;
 
+    stackprof_rehash_frames();
+    if (!_stackprof.frame_info_cache)
+	_stackprof.frame_info_cache = st_init_numtable();
+    _stackprof.frame_info_generation++;
+
     frames = rb_hash_new();
     rb_hash_aset(results, sym_frames, frames);
     st_foreach(_stackprof.frames, frame_i, (st_data_t)frames);
+    st_foreach(_stackprof.frame_info_cache, frame_info_free_i,
+	       _stackprof.frame_info_cache->num_entries > FRAME_INFO_CACHE_MAX);
 
     st_free_table(_stackprof.frames);
     _stackprof.frames = NULL;
 
-    if (_stackprof.raw && _stackprof.raw_samples_len) {
-	size_t len, n, o;
-	VALUE raw_sample_timestamps, raw_timestamp_deltas;
-	VALUE raw_samples = rb_ary_new_capa(_stackprof.raw_samples_len);
-	VALUE raw_lines = rb_ary_new_capa(_stackprof.raw_samples_len);
+    if (_stackprof.label_samples->num_entries) {
+	VALUE label_sets = rb_hash_new(), label_samples = rb_hash_new();
+
+	rb_hash_aset(label_sets, INT2FIX(0), RARRAY_AREF(_stackprof.label_sets, 0));
+	st_foreach(_stackprof.label_samples, label_samples_i, (st_data_t)label_samples);
+	st_foreach(_stackprof.label_samples, label_sets_i, (st_data_t)label_sets);
 
-	for (n = 0; n < _stackprof.raw_samples_len; n++) {
-	    len = (size_t)_stackprof.raw_samples[n];
-	    rb_ary_push(raw_samples, SIZET2NUM(len));
-	    rb_ary_push(raw_lines, SIZET2NUM(len));
+	rb_hash_aset(results, sym_label_sets, label_sets);
+	rb_hash_aset(results, sym_label_samples, label_samples);
+    }
+    st_free_table(_stackprof.label_samples);
+    _stackprof.label_samples = NULL;
+    rb_ary_resize(_stackprof.label_sets, 1);
+    st_clear(_stackprof.label_set_ids);
+    rb_hash_clear(_stackprof.label_set_cache);
 
-	    for (o = 0, n++; o < len; n++, o++) {
-		// Line is in the upper 16 bits
-		rb_ary_push(raw_lines, INT2NUM(_stackprof.raw_samples[n] >> 48));
+    if (RARRAY_LEN(_stackprof.metrics))
+	rb_hash_aset(results, sym_metrics, rb_ary_dup(_stackprof.metrics));
 
-		VALUE frame = _stackprof.raw_samples[n] & ~((uint64_t)0xFFFF << 48);
-		rb_ary_push(raw_samples, PTR2NUM(frame));
-	    }
+    if (_stackprof.raw && (_stackprof.raw_samples_len || _stackprof.spilled_chunks)) {
+	raw_results_t raw = { rb_ary_new(), rb_ary_new(), rb_ary_new(), rb_ary_new(), Qnil, rb_hash_new(), 0 };
 
-	    rb_ary_push(raw_samples, SIZET2NUM((size_t)_stackprof.raw_samples[n]));
-	    rb_ary_push(raw_lines, SIZET2NUM((size_t)_stackprof.raw_samples[n]));
-	}
+	if (_stackprof.spilled_chunks)
+	    stackprof_read_spill(&raw);
+	if (_stackprof.spill_errno)
+	    rb_warn("stackprof: raw samples could not be spilled to disk, results are incomplete: %s", strerror(_stackprof.spill_errno));
+	_stackprof.spill_errno = 0;
+	_stackprof.spill_path = Qnil;
+
+	raw_results_append(&raw, _stackprof.raw_samples, _stackprof.raw_samples_len,
+			   _stackprof.raw_sample_times, _stackprof.raw_sample_times_len, _stackprof.raw_sample_label_sets,
+			   _stackprof.raw_sample_weights);
 
 	free(_stackprof.raw_samples);
 	_stackprof.raw_samples = NULL;
@@ -441,30 +1604,43 @@ stackprof_results(int argc, VALUE *argv, VALUE self)
 	_stackprof.raw_samples_capa = 0;
 	_stackprof.raw_sample_index = 0;
 
-	rb_hash_aset(results, sym_raw, raw_samples);
-	rb_hash_aset(results, sym_raw_lines, raw_lines);
-
-	raw_sample_timestamps = rb_ary_new_capa(_stackprof.raw_sample_times_len);
-	raw_timestamp_deltas = rb_ary_new_capa(_stackprof.raw_sample_times_len);
-
-	for (n = 0; n < _stackprof.raw_sample_times_len; n++) {
-	    rb_ary_push(raw_sample_timestamps, ULL2NUM(_stackprof.raw_sample_times[n].timestamp_usec));
-	    rb_ary_push(raw_timestamp_deltas, LL2NUM(_stackprof.raw_sample_times[n].delta_usec));
+	rb_hash_aset(results, sym_raw, raw.samples);
+	rb_hash_aset(results, sym_raw_lines, raw.lines);
+	rb_hash_aset(results, sym_raw_sample_timestamps, raw.timestamps);
+	rb_hash_aset(results, sym_raw_timestamp_deltas, raw.deltas);
+	if (!NIL_P(raw.label_sets))
+	    rb_hash_aset(results, sym_raw_sample_label_sets, raw.label_sets);
+	if (RHASH_SIZE(raw.weights)) {
+	    long i;
+	    for (i = 0; i < RARRAY_LEN(_stackprof.metrics); i++) {
+		VALUE weights = rb_hash_lookup(raw.weights, RARRAY_AREF(_stackprof.metrics, i));
+		if (!NIL_P(weights))
+		    raw_weights_fill(weights, raw.sample_count);
+	    }
+	    rb_hash_aset(results, sym_raw_sample_weights, raw.weights);
 	}
 
+	free(_stackprof.raw_sample_label_sets);
+	_stackprof.raw_sample_label_sets = NULL;
+	free(_stackprof.raw_sample_weights);
+	_stackprof.raw_sample_weights = NULL;
 	free(_stackprof.raw_sample_times);
 	_stackprof.raw_sample_times = NULL;
 	_stackprof.raw_sample_times_len = 0;
 	_stackprof.raw_sample_times_capa = 0;
 
-	rb_hash_aset(results, sym_raw_sample_timestamps, raw_sample_timestamps);
-	rb_hash_aset(results, sym_raw_timestamp_deltas, raw_timestamp_deltas);
-
 	_stackprof.raw = 0;
     }
 
     if (argc == 1)
 	_stackprof.out = argv[0];
+    else if (_stackprof.forked && RTEST(_stackprof.out)) {
+	/* an IO is still the parent's, so the child's results are only returned */
+	if (rb_respond_to(_stackprof.out, rb_intern("to_io")))
+	    _stackprof.out = Qnil;
+	else
+	    _stackprof.out = stackprof_fork_out(rb_get_path(_stackprof.out));
+    }
 
     if (RTEST(_stackprof.out)) {
 	VALUE file;
@@ -492,12 +1668,127 @@ stackprof_run(int argc, VALUE *argv, VALUE self)
     return stackprof_results(0, 0, self);
 }
 
+static void
+stackprof_fiber_switch(rb_event_flag_t flag, VALUE data, VALUE self, ID mid, VALUE klass)
+{
+    VALUE labels = rb_thread_local_aref(rb_thread_current(), id_labels);
+    current_labels = NIL_P(labels) ? 0 : labels;
+}
+
+static VALUE
+stackprof_restore_labels(VALUE labels)
+{
+    rb_thread_local_aset(rb_thread_current(), id_labels, labels);
+    current_labels = labels == Qnil ? 0 : labels;
+    return Qnil;
+}
+
+static VALUE
+stackprof_with_labels(VALUE self, VALUE labels)
+{
+    static int fiber_hook_added = 0;
+    VALUE label_set, prev, ret;
+
+    rb_need_block();
+    Check_Type(labels, T_HASH);
+
+    /* nothing to attribute samples to */
+    if (!STACKPROF_RUNNING())
+	return rb_yield(Qundef);
+
+    prev = rb_thread_local_aref(rb_thread_current(), id_labels);
+    label_set = RTEST(prev) ? rb_hash_dup(prev) : rb_hash_new();
+    rb_funcall(label_set, rb_intern("update"), 1, labels);
+    if (RHASH_SIZE(label_set) == 0)
+	return rb_yield(Qundef);
+    rb_obj_freeze(label_set);
+
+    /* equal label sets are the same object, and so get the same id */
+    label_set = rb_hash_lookup2(_stackprof.label_set_cache, label_set, label_set);
+    rb_hash_aset(_stackprof.label_set_cache, label_set, label_set);
+
+    /* only programs that use labels pay for following fiber switches */
+    if (!fiber_hook_added) {
+	rb_add_event_hook(stackprof_fiber_switch, RUBY_EVENT_FIBER_SWITCH, Qnil);
+	fiber_hook_added = 1;
+    }
+
+    rb_thread_local_aset(rb_thread_current(), id_labels, label_set);
+    current_labels = label_set;
+    ret = rb_ensure(rb_yield, Qundef, stackprof_restore_labels, prev);
+    RB_GC_GUARD(label_set);
+    return ret;
+}
+
 static VALUE
 stackprof_running_p(VALUE self)
 {
     return STACKPROF_RUNNING() ? Qtrue : Qfalse;
 }
 
+#if STACKPROF_GC_COMPACT
+static int
+frame_rehash_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    st_insert((st_table *)arg, key, val);
+    return ST_CONTINUE;
+}
+
+static st_table *
+frame_table_rehash(st_table *table)
+{
+    st_table *rehashed;
+
+    if (!table)
+	return NULL;
+    rehashed = st_init_numtable_with_size(table->num_entries);
+    st_foreach(table, frame_rehash_i, (st_data_t)rehashed);
+    st_free_table(table);
+    return rehashed;
+}
+
+static int
+frame_metric_rehash_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    frame_metric_t *metric = (frame_metric_t *)val;
+    metric->edges = frame_table_rehash(metric->edges);
+    return ST_CONTINUE;
+}
+
+static int
+frame_data_rehash_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    frame_data_t *frame_data = (frame_data_t *)val;
+    frame_data->edges = frame_table_rehash(frame_data->edges);
+    if (frame_data->metrics)
+	st_foreach(frame_data->metrics, frame_metric_rehash_i, 0);
+    return ST_CONTINUE;
+}
+
+/* Rebuilds the tables keyed by frame after compaction moved some of their
+ * keys, before they are looked up again. The replacement tables are
+ * malloc'd, which may start a GC; it is held off meanwhile, as compacting
+ * now would move keys already copied into tables it can't see. */
+static void
+stackprof_rehash_frames(void)
+{
+    VALUE gc_disabled;
+
+    if (!_stackprof.frames_moved)
+	return;
+    _stackprof.frames_moved = 0;
+
+    gc_disabled = rb_gc_disable();
+    if (_stackprof.frames) {
+	st_foreach(_stackprof.frames, frame_data_rehash_i, 0);
+	_stackprof.frames = frame_table_rehash(_stackprof.frames);
+    }
+    _stackprof.frame_info_cache = frame_table_rehash(_stackprof.frame_info_cache);
+    if (!RTEST(gc_disabled))
+	rb_gc_enable();
+}
+#endif
+
 static inline frame_data_t *
 sample_for(VALUE frame)
 {
@@ -516,6 +1807,23 @@ sample_for(VALUE frame)
     return frame_data;
 }
 
+static inline frame_metric_t *
+metric_for(frame_data_t *frame_data, int metric)
+{
+    st_data_t val = 0;
+    frame_metric_t *frame_metric;
+
+    if (!frame_data->metrics)
+	frame_data->metrics = st_init_numtable();
+    if (st_lookup(frame_data->metrics, (st_data_t)metric, &val))
+	return (frame_metric_t *)val;
+
+    frame_metric = ALLOC_N(frame_metric_t, 1);
+    MEMZERO(frame_metric, frame_metric_t, 1);
+    st_insert(frame_data->metrics, (st_data_t)metric, (st_data_t)frame_metric);
+    return frame_metric;
+}
+
 static int
 numtable_increment_callback(st_data_t *key, st_data_t *value, st_data_t arg, int existing)
 {
@@ -536,12 +1844,34 @@ st_numtable_increment(st_table *table, st_data_t key, size_t increment)
     st_update(table, key, numtable_increment_callback, (st_data_t)increment);
 }
 
+static int
+label_set_id(VALUE labels)
+{
+    st_data_t id;
+
+    if (!labels)
+	return 0;
+    if (!st_lookup(_stackprof.label_set_ids, (st_data_t)labels, &id)) {
+	id = (st_data_t)RARRAY_LEN(_stackprof.label_sets);
+	rb_ary_push(_stackprof.label_sets, labels);
+	st_insert(_stackprof.label_set_ids, (st_data_t)labels, id);
+    }
+    return (int)id;
+}
+
 void
 stackprof_record_sample_for_stack(int num, uint64_t sample_timestamp, int64_t timestamp_delta)
 {
-    int i, n;
+    int i, n, label_set;
     VALUE prev_frame = Qnil;
 
+    stackprof_rehash_frames();
+    if (!_stackprof.frames) {
+	/* first sample of a forked child, see stackprof_fork_reset */
+	_stackprof.frames = st_init_numtable();
+	_stackprof.label_samples = st_init_numtable();
+    }
+    label_set = label_set_id(_stackprof.sample_labels);
     _stackprof.overall_samples++;
 
     if (_stackprof.raw && num > 0) {
@@ -616,31 +1946,67 @@ stackprof_record_sample_for_stack(int num, uint64_t sample_timestamp, int64_t ti
 	while (_stackprof.raw_sample_times_capa <= _stackprof.raw_sample_times_len + 1) {
 	    _stackprof.raw_sample_times_capa *= 2;
 	    _stackprof.raw_sample_times = realloc(_stackprof.raw_sample_times, sizeof(sample_time_t) * _stackprof.raw_sample_times_capa);
+	    if (_stackprof.raw_sample_label_sets)
+		_stackprof.raw_sample_label_sets = realloc(_stackprof.raw_sample_label_sets, sizeof(int) * _stackprof.raw_sample_times_capa);
+	    if (_stackprof.raw_sample_weights)
+		_stackprof.raw_sample_weights = realloc(_stackprof.raw_sample_weights, sizeof(sample_weight_t) * _stackprof.raw_sample_times_capa);
 	}
 
+	/* Label sets are stored alongside the times once the first labeled
+	 * sample shows up; earlier samples are unlabeled (0). */
+	if (label_set && !_stackprof.raw_sample_label_sets)
+	    _stackprof.raw_sample_label_sets = calloc(_stackprof.raw_sample_times_capa, sizeof(int));
+	if (_stackprof.raw_sample_label_sets)
+	    _stackprof.raw_sample_label_sets[_stackprof.raw_sample_times_len] = label_set;
+
+	/* The same goes for weights, from the first weighted sample on. */
+	if (_stackprof.sample_metric && !_stackprof.raw_sample_weights)
+	    _stackprof.raw_sample_weights = calloc(_stackprof.raw_sample_times_capa, sizeof(sample_weight_t));
+	if (_stackprof.raw_sample_weights)
+	    _stackprof.raw_sample_weights[_stackprof.raw_sample_times_len] = (sample_weight_t) {
+		.metric = _stackprof.sample_metric,
+		.weight = _stackprof.sample_weight,
+	    };
+
 	/* Store the time delta (which is the amount of microseconds between samples). */
 	_stackprof.raw_sample_times[_stackprof.raw_sample_times_len++] = (sample_time_t) {
 	    .timestamp_usec = sample_timestamp,
 	    .delta_usec = timestamp_delta,
         };
+
+	if (!NIL_P(_stackprof.spill_path) &&
+	    (_stackprof.raw_sample_times_len >= _stackprof.spill_chunk || _stackprof.raw_samples_len >= _stackprof.spill_chunk * 16))
+	    stackprof_spill_chunk();
     }
 
+    if (label_set)
+	st_numtable_increment(_stackprof.label_samples, (st_data_t)label_set, 1);
+
     for (i = 0; i < num; i++) {
 	int line = _stackprof.lines_buffer[i];
 	VALUE frame = _stackprof.frames_buffer[i];
 	frame_data_t *frame_data = sample_for(frame);
+	frame_metric_t *metric = _stackprof.sample_metric ? metric_for(frame_data, _stackprof.sample_metric) : NULL;
+	size_t weight = _stackprof.sample_weight;
 
 	if (frame_data->seen_at_sample_number != _stackprof.overall_samples) {
 	    frame_data->total_samples++;
+	    if (metric) metric->total += weight;
 	}
 	frame_data->seen_at_sample_number = _stackprof.overall_samples;
 
 	if (i == 0) {
 	    frame_data->caller_samples++;
+	    if (metric) metric->self += weight;
 	} else if (_stackprof.aggregate) {
 	    if (!frame_data->edges)
 		frame_data->edges = st_init_numtable();
 	    st_numtable_increment(frame_data->edges, (st_data_t)prev_frame, 1);
+	    if (metric) {
+		if (!metric->edges)
+		    metric->edges = st_init_numtable();
+		st_numtable_increment(metric->edges, (st_data_t)prev_frame, weight);
+	    }
 	}
 
 	if (_stackprof.aggregate && line > 0) {
@@ -649,6 +2015,16 @@ stackprof_record_sample_for_stack(int num, uint64_t sample_timestamp, int64_t ti
 	    if (!frame_data->lines)
 		frame_data->lines = st_init_numtable();
 	    st_numtable_increment(frame_data->lines, (st_data_t)line, increment);
+	    /* weights are too large to share a word like the counts do */
+	    if (metric) {
+		if (!metric->lines) {
+		    metric->lines = st_init_numtable();
+		    metric->self_lines = st_init_numtable();
+		}
+		st_numtable_increment(metric->lines, (st_data_t)line, weight);
+		if (i == 0)
+		    st_numtable_increment(metric->self_lines, (st_data_t)line, weight);
+	    }
 	}
 
 	prev_frame = frame;
@@ -659,18 +2035,88 @@ stackprof_record_sample_for_stack(int num, uint64_t sample_timestamp, int64_t ti
     }
 }
 
+/* Collapses consecutive repetitions of the same cycle of up to
+ * FOLD_MAX_CYCLE frames, keeping the copy nearest to the leaf (and its
+ * lines). Each frame is appended in turn and the tail dropped if it repeats
+ * the cycle just before it, so what has been kept so far never ends in a
+ * repetition and a single check per frame is enough. */
+static int
+stackprof_fold_recursion(int num, VALUE *frames, int *lines)
+{
+    int i, len, out = 0;
+
+    for (i = 0; i < num; i++) {
+	frames[out] = frames[i];
+	lines[out] = lines[i];
+	out++;
+
+	for (len = 1; len <= FOLD_MAX_CYCLE && 2 * len <= out; len++) {
+	    if (memcmp(&frames[out - len], &frames[out - 2 * len], len * sizeof(VALUE)) == 0) {
+		out -= len;
+		break;
+	    }
+	}
+    }
+
+    return out;
+}
+
+/* Captures the Ruby frames of the current thread, leaf first, applying
+ * max_depth (the frames nearest to the root are replaced by a (truncated)
+ * frame) and fold_recursion. Async-signal-safe. */
+static int
+stackprof_capture_frames(VALUE *frames, int *lines, int limit)
+{
+    int num;
+
+    if (_stackprof.max_depth && _stackprof.max_depth < limit) {
+	/* one more frame than needed tells whether the stack is deeper */
+	num = rb_profile_frames(0, _stackprof.max_depth + 1, frames, lines);
+	if (num > _stackprof.max_depth) {
+	    num = _stackprof.max_depth;
+	    frames[num] = FAKE_FRAME_TRUNCATED;
+	    lines[num] = 0;
+	    num++;
+	}
+    } else {
+	num = rb_profile_frames(0, limit, frames, lines);
+    }
+
+    if (_stackprof.fold_recursion)
+	num = stackprof_fold_recursion(num, frames, lines);
+
+    return num;
+}
+
 // buffer the current profile frames
 // This must be async-signal-safe
 // Returns immediately if another set of frames are already in the buffer
 void
-stackprof_buffer_sample(void)
+stackprof_buffer_sample(void *ucontext)
 {
     uint64_t start_timestamp = 0;
     int64_t timestamp_delta = 0;
     int num;
 
     if (_stackprof.buffer_count > 0) {
-	// Another sample is already pending
+	// Another sample is already pending. If the thread has stayed off the
+	// GVL since it was taken, its Ruby stack can't have changed, so count
+	// this signal as one more sample of the pending stack.
+	if (_stackprof.thread_states &&
+	    _stackprof.sampled_thread_state != THREAD_STATE_RUNNING &&
+	    _stackprof.sampled_thread_state == _stackprof.buffer_thread_state &&
+	    _stackprof.gvl_generation == _stackprof.buffer_gvl_generation) {
+	    if (_stackprof.raw) {
+		// raw samples keep their time; past what fits, they are missed
+		struct timestamp_t t;
+		if (_stackprof.buffer_repeats >= REPEAT_BUF_SIZE)
+		    return;
+		capture_timestamp(&t);
+		_stackprof.buffer_repeat_times[_stackprof.buffer_repeats] = timestamp_usec(&t);
+	    }
+	    _stackprof.thread_state_samples[_stackprof.sampled_thread_state]++;
+	    _stackprof.buffer_repeats++;
+	}
 	return;
     }
 
@@ -681,11 +2127,41 @@ stackprof_buffer_sample(void)
 	timestamp_delta = delta_usec(&_stackprof.last_sample_at, &t);
     }
 
-    num = rb_profile_frames(0, sizeof(_stackprof.frames_buffer) / sizeof(VALUE), _stackprof.frames_buffer, _stackprof.lines_buffer);
+    if (_stackprof.thread_states && _stackprof.sampled_thread_state != THREAD_STATE_RUNNING) {
+	/* The thread is off the GVL: record where it is waiting, topped by a
+	 * fake frame naming the state. */
+	_stackprof.thread_state_samples[_stackprof.sampled_thread_state]++;
+	_stackprof.frames_buffer[0] = _stackprof.sampled_thread_state == THREAD_STATE_GVL_WAIT ? FAKE_FRAME_GVL_WAIT : FAKE_FRAME_BLOCKED;
+	_stackprof.lines_buffer[0] = 0;
+	num = 1 + stackprof_capture_frames(_stackprof.frames_buffer + 1, _stackprof.lines_buffer + 1, BUF_SIZE - 1);
+    } else {
+	if (_stackprof.thread_states)
+	    _stackprof.thread_state_samples[THREAD_STATE_RUNNING]++;
+	num = stackprof_capture_frames(_stackprof.frames_buffer, _stackprof.lines_buffer, BUF_SIZE);
+    }
+
+#if STACKPROF_NATIVE_STACKS
+    /* the stack bounds are the target thread's */
+    if (_stackprof.native && ucontext && pthread_self() == _stackprof.target_thread)
+	_stackprof.native_buffer_count = stackprof_native_walk(ucontext, _stackprof.native_buffer, NATIVE_BUF_SIZE);
+#endif
 
     _stackprof.buffer_count = num;
     _stackprof.buffer_time.timestamp_usec = start_timestamp;
     _stackprof.buffer_time.delta_usec = timestamp_delta;
+    _stackprof.buffer_thread_state = _stackprof.sampled_thread_state;
+    _stackprof.buffer_labels = current_labels;
+    _stackprof.buffer_gvl_generation = _stackprof.gvl_generation;
+}
+
+/* Microseconds between two samples, or 0 when the interval counts events
+ * (perf mode, except for task_clock) and so says nothing about time. */
+static int64_t
+stackprof_sample_period_usec(void)
+{
+    if (_stackprof.mode == sym_perf && _stackprof.event != sym_task_clock)
+	return 0;
+    return NUM2LONG(_stackprof.interval);
 }
 
 // Postponed job
@@ -693,22 +2169,34 @@ void
 stackprof_record_gc_samples(void)
 {
     int64_t delta_to_first_unrecorded_gc_sample = 0;
+    int64_t period = stackprof_sample_period_usec(), step = 0;
     uint64_t start_timestamp = 0;
     size_t i;
     if (_stackprof.raw) {
 	struct timestamp_t t = _stackprof.gc_start_timestamp;
 	start_timestamp = timestamp_usec(&t);
 
-	// We don't know when the GC samples were actually marked, so let's
-	// assume that they were marked at a perfectly regular interval.
-	delta_to_first_unrecorded_gc_sample = delta_usec(&_stackprof.last_sample_at, &t) - (_stackprof.unrecorded_gc_samples - 1) * NUM2LONG(_stackprof.interval);
+	if (period) {
+	    // We don't know when the GC samples were actually marked, so let's
+	    // assume that they were marked at a perfectly regular interval.
+	    delta_to_first_unrecorded_gc_sample = delta_usec(&_stackprof.last_sample_at, &t) - (_stackprof.unrecorded_gc_samples - 1) * period;
+	} else {
+	    // The interval counts events: spread the samples over the time
+	    // from the first of them to now.
+	    struct timestamp_t now;
+	    capture_timestamp(&now);
+	    delta_to_first_unrecorded_gc_sample = delta_usec(&_stackprof.last_sample_at, &t);
+	    period = step = delta_usec(&t, &now) / (int64_t)_stackprof.unrecorded_gc_samples;
+	}
 	if (delta_to_first_unrecorded_gc_sample < 0) {
 	    delta_to_first_unrecorded_gc_sample = 0;
 	}
     }
 
+    _stackprof.sample_labels = current_labels;
+
     for (i = 0; i < _stackprof.unrecorded_gc_samples; i++) {
-	int64_t timestamp_delta = i == 0 ? delta_to_first_unrecorded_gc_sample : NUM2LONG(_stackprof.interval);
+	int64_t timestamp_delta = i == 0 ? delta_to_first_unrecorded_gc_sample : period;
 
       if (_stackprof.unrecorded_gc_marking_samples) {
         _stackprof.frames_buffer[0] = FAKE_FRAME_MARK;
@@ -717,7 +2205,7 @@ stackprof_record_gc_samples(void)
         _stackprof.lines_buffer[1] = 0;
         _stackprof.unrecorded_gc_marking_samples--;
 
-        stackprof_record_sample_for_stack(2, start_timestamp, timestamp_delta);
+        stackprof_record_sample_for_stack(2, start_timestamp + i * step, timestamp_delta);
       } else if (_stackprof.unrecorded_gc_sweeping_samples) {
         _stackprof.frames_buffer[0] = FAKE_FRAME_SWEEP;
         _stackprof.lines_buffer[0] = 0;
@@ -726,11 +2214,11 @@ stackprof_record_gc_samples(void)
 
         _stackprof.unrecorded_gc_sweeping_samples--;
 
-        stackprof_record_sample_for_stack(2, start_timestamp, timestamp_delta);
+        stackprof_record_sample_for_stack(2, start_timestamp + i * step, timestamp_delta);
       } else {
         _stackprof.frames_buffer[0] = FAKE_FRAME_GC;
         _stackprof.lines_buffer[0] = 0;
-        stackprof_record_sample_for_stack(1, start_timestamp, timestamp_delta);
+        stackprof_record_sample_for_stack(1, start_timestamp + i * step, timestamp_delta);
       }
     }
     _stackprof.during_gc += _stackprof.unrecorded_gc_samples;
@@ -743,8 +2231,24 @@ stackprof_record_gc_samples(void)
 static void
 stackprof_record_buffer(void)
 {
+    size_t i, repeats = _stackprof.buffer_repeats;
+    uint64_t prev_timestamp = _stackprof.buffer_time.timestamp_usec;
+
+    _stackprof.sample_labels = _stackprof.buffer_labels;
+#if STACKPROF_NATIVE_STACKS
+    if (_stackprof.native_buffer_count)
+	_stackprof.buffer_count = stackprof_splice_native_frames(_stackprof.buffer_count);
+#endif
     stackprof_record_sample_for_stack(_stackprof.buffer_count, _stackprof.buffer_time.timestamp_usec, _stackprof.buffer_time.delta_usec);
 
+    // samples of an off-GVL thread folded into this one by stackprof_buffer_sample
+    for (i = 0; i < repeats; i++) {
+	uint64_t timestamp = _stackprof.raw ? _stackprof.buffer_repeat_times[i] : 0;
+	stackprof_record_sample_for_stack(_stackprof.buffer_count, timestamp, (int64_t)(timestamp - prev_timestamp));
+	prev_timestamp = timestamp;
+    }
+    _stackprof.buffer_repeats = 0;
+
     // reset the buffer
     _stackprof.buffer_count = 0;
 }
@@ -752,7 +2256,7 @@ stackprof_record_buffer(void)
 static void
 stackprof_sample_and_record(void)
 {
-    stackprof_buffer_sample();
+    stackprof_buffer_sample(NULL);
     stackprof_record_buffer();
 }
 
@@ -805,6 +2309,8 @@ stackprof_signal_handler(int sig, siginfo_t *sinfo, void *ucontext)
             pthread_kill(_stackprof.target_thread, sig);
             return;
         }
+        if (_stackprof.thread_states)
+            _stackprof.sampled_thread_state = TARGET_THREAD_STATE();
     } else {
         if (!ruby_native_thread_p()) return;
     }
@@ -830,7 +2336,7 @@ stackprof_signal_handler(int sig, siginfo_t *sinfo, void *ucontext)
         } else {
             // Buffer a sample immediately, if an existing sample exists this will
             // return immediately
-            stackprof_buffer_sample();
+            stackprof_buffer_sample(ucontext);
             // Enqueue a job to record the sample
             trigger_job(job_record_buffer);
         }
@@ -848,21 +2354,77 @@ stackprof_newobj_handler(VALUE tpval, void *data)
 }
 
 static VALUE
-stackprof_sample(VALUE self)
+stackprof_sample(int argc, VALUE *argv, VALUE self)
 {
+    VALUE weight = Qnil, opts = Qnil, metric = Qnil, id;
+
     if (!STACKPROF_RUNNING())
 	return Qfalse;
 
+    rb_scan_args(argc, argv, "01:", &weight, &opts);
+    if (RTEST(opts))
+	metric = rb_hash_aref(opts, sym_metric);
+
+    if (!NIL_P(weight) || !NIL_P(metric)) {
+	if (_stackprof.mode != sym_custom)
+	    rb_raise(rb_eArgError, "weighted samples are only supported in custom mode");
+	if (NIL_P(weight))
+	    weight = INT2FIX(1);
+	if (!RB_INTEGER_TYPE_P(weight) || RTEST(rb_funcall(weight, '<', 1, INT2FIX(0))))
+	    rb_raise(rb_eArgError, "weight must be a non-negative Integer");
+	if (NIL_P(metric))
+	    metric = sym_weight;
+	else if (RB_TYPE_P(metric, T_STRING))
+	    metric = rb_str_intern(metric);
+	else if (!SYMBOL_P(metric))
+	    rb_raise(rb_eArgError, "metric must be a Symbol");
+
+	id = rb_hash_lookup2(_stackprof.metric_ids, metric, Qnil);
+	if (NIL_P(id)) {
+	    id = LONG2FIX(RARRAY_LEN(_stackprof.metrics) + 1);
+	    rb_ary_push(_stackprof.metrics, metric);
+	    rb_hash_aset(_stackprof.metric_ids, metric, id);
+	}
+	_stackprof.sample_metric = FIX2INT(id);
+	_stackprof.sample_weight = NUM2SIZET(weight);
+    }
+
     _stackprof.overall_signals++;
     stackprof_sample_and_record();
+    _stackprof.sample_metric = 0;
+    _stackprof.sample_weight = 0;
     return Qtrue;
 }
 
+/* Frames are marked movable and updated by stackprof_gc_compact, except
+ * once raw samples have been spilled: the VALUEs in the spill file can't be
+ * updated, so every frame (all of which are in the frames table) stays put
+ * until results reads them back. */
 static int
 frame_mark_i(st_data_t key, st_data_t val, st_data_t arg)
 {
     VALUE frame = (VALUE)key;
-    rb_gc_mark(frame);
+    if (_stackprof.spilled_chunks)
+	rb_gc_mark(frame);
+    else
+	rb_gc_mark_movable(frame);
+    return ST_CONTINUE;
+}
+
+static int
+label_set_mark_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    rb_gc_mark((VALUE)key);
+    return ST_CONTINUE;
+}
+
+static int
+frame_info_mark_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    frame_info_t *info = (frame_info_t *)val;
+    rb_gc_mark_movable((VALUE)key);
+    rb_gc_mark_movable(info->name);
+    rb_gc_mark_movable(info->file);
     return ST_CONTINUE;
 }
 
@@ -875,14 +2437,110 @@ stackprof_gc_mark(void *data)
     if (RTEST(_stackprof.out))
 	rb_gc_mark(_stackprof.out);
 
+    if (RTEST(_stackprof.target_rb_thread))
+	rb_gc_mark(_stackprof.target_rb_thread);
+
     if (_stackprof.frames)
 	st_foreach(_stackprof.frames, frame_mark_i, 0);
 
+    if (_stackprof.frame_info_cache)
+	st_foreach(_stackprof.frame_info_cache, frame_info_mark_i, 0);
+
+    /* Numbered label sets are looked up by address, so they stay put. */
+    if (_stackprof.label_set_ids)
+	st_foreach(_stackprof.label_set_ids, label_set_mark_i, 0);
+    if (_stackprof.buffer_labels)
+	rb_gc_mark(_stackprof.buffer_labels);
+
+    int i;
+    for (i = 0; i < _stackprof.buffer_count; i++) {
+        rb_gc_mark_movable(_stackprof.frames_buffer[i]);
+    }
+}
+
+#if STACKPROF_GC_COMPACT
+static int
+frame_moved_i(st_data_t key, st_data_t val, st_data_t arg, int error)
+{
+    return rb_gc_location((VALUE)key) == (VALUE)key ? ST_CONTINUE : ST_REPLACE;
+}
+
+static int
+frame_replace_i(st_data_t *key, st_data_t *val, st_data_t arg, int existing)
+{
+    *key = (st_data_t)rb_gc_location((VALUE)*key);
+    _stackprof.frames_moved = 1;
+    return ST_CONTINUE;
+}
+
+/* Nothing can be allocated during compaction, so moved keys are replaced
+ * in place, leaving the table hashed by their old address until
+ * stackprof_rehash_frames rebuilds it. */
+static void
+frame_table_compact(st_table *table)
+{
+    if (table)
+	st_foreach_with_replace(table, frame_moved_i, frame_replace_i, 0);
+}
+
+static int
+frame_metric_compact_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    frame_table_compact(((frame_metric_t *)val)->edges);
+    return ST_CONTINUE;
+}
+
+static int
+frame_compact_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    frame_data_t *frame_data = (frame_data_t *)val;
+    frame_table_compact(frame_data->edges);
+    if (frame_data->metrics)
+	st_foreach(frame_data->metrics, frame_metric_compact_i, 0);
+    return ST_CONTINUE;
+}
+
+static int
+frame_info_compact_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+    frame_info_t *info = (frame_info_t *)val;
+    info->name = rb_gc_location(info->name);
+    info->file = rb_gc_location(info->file);
+    return ST_CONTINUE;
+}
+
+static void
+stackprof_gc_compact(void *data)
+{
+    size_t n, o, len;
     int i;
+
+    if (_stackprof.frames) {
+	st_foreach(_stackprof.frames, frame_compact_i, 0);
+	frame_table_compact(_stackprof.frames);
+    }
+
+    if (_stackprof.frame_info_cache) {
+	st_foreach(_stackprof.frame_info_cache, frame_info_compact_i, 0);
+	frame_table_compact(_stackprof.frame_info_cache);
+    }
+
+    /* raw entries are the number of frames, the frames (with the line in
+     * the upper 16 bits) and the count, see stackprof_record_sample_for_stack */
+    for (n = 0; n < _stackprof.raw_samples_len; n++) {
+	len = (size_t)_stackprof.raw_samples[n];
+	for (o = 0, n++; o < len; n++, o++) {
+	    uint64_t line = _stackprof.raw_samples[n] & ((uint64_t)0xFFFF << 48);
+	    VALUE frame = _stackprof.raw_samples[n] & ~((uint64_t)0xFFFF << 48);
+	    _stackprof.raw_samples[n] = line | (uint64_t)rb_gc_location(frame);
+	}
+    }
+
     for (i = 0; i < _stackprof.buffer_count; i++) {
-        rb_gc_mark(_stackprof.frames_buffer[i]);
+	_stackprof.frames_buffer[i] = rb_gc_location(_stackprof.frames_buffer[i]);
     }
 }
+#endif
 
 static size_t
 stackprof_memsize(const void *data)
@@ -916,9 +2574,115 @@ stackprof_atfork_parent(void)
     }
 }
 
+/* Starts the profile of a child over (fork: :continue). The parent's
+ * samples are dropped without being freed: they are shared with the parent
+ * until written to, so freeing them would copy every page they are on. The
+ * tables are allocated again by the child's first sample, not here where
+ * Ruby isn't ready to run a GC. Sampling isn't resumed yet: the child may
+ * be about to exec, and would take an interval timer with it, so only
+ * StackProf._fork_continue, once the fork has returned to Ruby, resumes it. */
+static void
+stackprof_fork_reset(void)
+{
+    _stackprof.frames = NULL;
+    _stackprof.label_samples = NULL;
+    _stackprof.raw_samples = NULL;
+    _stackprof.raw_samples_len = 0;
+    _stackprof.raw_samples_capa = 0;
+    _stackprof.raw_sample_index = 0;
+    _stackprof.raw_sample_times = NULL;
+    _stackprof.raw_sample_times_len = 0;
+    _stackprof.raw_sample_times_capa = 0;
+    _stackprof.raw_sample_label_sets = NULL;
+    _stackprof.raw_sample_weights = NULL;
+    _stackprof.overall_signals = 0;
+    _stackprof.overall_samples = 0;
+    _stackprof.during_gc = 0;
+    _stackprof.unrecorded_gc_samples = 0;
+    _stackprof.unrecorded_gc_marking_samples = 0;
+    _stackprof.unrecorded_gc_sweeping_samples = 0;
+    _stackprof.buffer_count = 0;
+    _stackprof.buffer_repeats = 0;
+    MEMZERO(_stackprof.thread_state_samples, size_t, TOTAL_THREAD_STATES);
+
+    /* only the forking thread exists in the child */
+    _stackprof.target_thread = pthread_self();
+    _stackprof.forked = 1;
+    _stackprof.fork_pending = 1;
+}
+
+/* Resumes sampling in a child forked from Ruby, on the thread that forked,
+ * which may not be the one the parent was profiling. Returns whether the
+ * child is profiling. */
+static VALUE
+stackprof_fork_continue_m(VALUE self)
+{
+    struct itimerval timer;
+
+    if (!STACKPROF_RUNNING() || !_stackprof.fork_pending)
+	return Qfalse;
+    _stackprof.fork_pending = 0;
+
+    _stackprof.target_rb_thread = rb_thread_current();
+    SET_TARGET_THREAD_STATE(THREAD_STATE_RUNNING);
+#if STACKPROF_NATIVE_STACKS
+    if (_stackprof.native)
+	stackprof_native_init();
+#endif
+    if (_stackprof.raw)
+	capture_timestamp(&_stackprof.last_sample_at);
+
+    /* interval timers are not inherited */
+    if (_stackprof.mode == sym_wall || _stackprof.mode == sym_cpu) {
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = NUM2UINT(_stackprof.interval);
+	timer.it_value = timer.it_interval;
+	setitimer(_stackprof.mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    } else if (_stackprof.mode == sym_perf) {
+	struct perf_event_attr attr;
+
+	stackprof_perf_attr(&attr, _stackprof.event, NUM2ULONG(_stackprof.interval));
+	_stackprof.perf_fd = stackprof_perf_fd(&attr);
+	if (_stackprof.perf_fd < 0) {
+	    stackprof_stop(self);
+	    return Qfalse;
+	}
+	ioctl(_stackprof.perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    return Qtrue;
+}
+
 static void
 stackprof_atfork_child(void)
 {
+    /* The writer thread doesn't exist in the child, and the spill file
+     * belongs to the parent. Chunks spilled so far are lost to the child. */
+    if (_stackprof.spill_writer_started) {
+	close(_stackprof.spill_fd);
+	_stackprof.spill_fd = -1;
+	_stackprof.spill_writer_started = 0;
+	_stackprof.spill_head = _stackprof.spill_tail = NULL;
+	pthread_mutex_init(&_stackprof.spill_lock, NULL);
+	pthread_cond_init(&_stackprof.spill_cond, NULL);
+    }
+    _stackprof.spill_path = Qnil;
+    _stackprof.spilled_chunks = 0;
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    /* The inherited descriptor still refers to the parent's counter, which
+     * disabling it here would stop. */
+    if (STACKPROF_RUNNING() && _stackprof.mode == sym_perf && _stackprof.perf_fd >= 0) {
+	close(_stackprof.perf_fd);
+	_stackprof.perf_fd = -1;
+    }
+#endif
+    if (STACKPROF_RUNNING() && _stackprof.fork_continue) {
+	stackprof_fork_reset();
+	return;
+    }
     stackprof_stop(rb_mStackProf);
 }
 
@@ -941,6 +2705,9 @@ static const rb_data_type_t stackprof_type = {
         stackprof_gc_mark,
         NULL,
         stackprof_memsize,
+#if STACKPROF_GC_COMPACT
+        stackprof_gc_compact,
+#endif
     }
 };
 
@@ -986,14 +2753,49 @@ Init_stackprof(void)
     S(state);
     S(marking);
     S(sweeping);
+    S(thread_states);
+    S(running);
+    S(gvl_wait);
+    S(blocked);
+    S(label_sets);
+    S(label_samples);
+    S(raw_sample_label_sets);
+    S(metric);
+    S(metrics);
+    S(weight);
+    S(raw_sample_weights);
+    S(native);
+    S(max_depth);
+    S(fold_recursion);
+    S(spill);
+    S(spill_chunk);
+    S(fork);
+    S(continue);
+    S(stop);
+    S(perf);
+    S(event);
+    S(task_clock);
+    S(page_faults);
+    S(context_switches);
+    S(cpu_migrations);
 #undef S
 
+    id_labels = rb_intern("__stackprof_labels__");
+
     /* Need to run this to warm the symbol table before we call this during GC */
     rb_gc_latest_gc_info(sym_state);
 
     rb_global_variable(&gc_hook);
     gc_hook = TypedData_Wrap_Struct(rb_cObject, &stackprof_type, &_stackprof);
 
+    _stackprof.perf_fd = -1;
+
+    _stackprof.spill_fd = -1;
+    _stackprof.spill_path = Qnil;
+    rb_global_variable(&_stackprof.spill_path);
+    pthread_mutex_init(&_stackprof.spill_lock, NULL);
+    pthread_cond_init(&_stackprof.spill_cond, NULL);
+
     _stackprof.raw_samples = NULL;
     _stackprof.raw_samples_len = 0;
     _stackprof.raw_samples_capa = 0;
@@ -1006,6 +2808,19 @@ Init_stackprof(void)
     _stackprof.empty_string = rb_str_new_cstr("");
     rb_global_variable(&_stackprof.empty_string);
 
+    /* label set 0 is "no labels" */
+    _stackprof.label_sets = rb_ary_new();
+    rb_global_variable(&_stackprof.label_sets);
+    rb_ary_push(_stackprof.label_sets, rb_obj_freeze(rb_hash_new()));
+    _stackprof.label_set_ids = st_init_numtable();
+    _stackprof.label_set_cache = rb_hash_new();
+    rb_global_variable(&_stackprof.label_set_cache);
+
+    _stackprof.metrics = rb_ary_new();
+    rb_global_variable(&_stackprof.metrics);
+    _stackprof.metric_ids = rb_hash_new();
+    rb_global_variable(&_stackprof.metric_ids);
+
     for (i = 0; i < TOTAL_FAKE_FRAMES; i++) {
 	    _stackprof.fake_frame_names[i] = rb_str_new_cstr(fake_frame_cstrs[i]);
 	    rb_global_variable(&_stackprof.fake_frame_names[i]);
@@ -1017,8 +2832,10 @@ Init_stackprof(void)
     rb_define_singleton_method(rb_mStackProf, "start", stackprof_start, -1);
     rb_define_singleton_method(rb_mStackProf, "stop", stackprof_stop, 0);
     rb_define_singleton_method(rb_mStackProf, "results", stackprof_results, -1);
-    rb_define_singleton_method(rb_mStackProf, "sample", stackprof_sample, 0);
+    rb_define_singleton_method(rb_mStackProf, "sample", stackprof_sample, -1);
+    rb_define_singleton_method(rb_mStackProf, "with_labels", stackprof_with_labels, 1);
     rb_define_singleton_method(rb_mStackProf, "use_postponed_job!", stackprof_use_postponed_job_l, 0);
+    rb_define_singleton_method(rb_mStackProf, "_fork_continue", stackprof_fork_continue_m, 0);
 
     preregister_job(job_record_gc);
     preregister_job(job_sample_and_record);
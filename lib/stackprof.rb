@@ -19,7 +19,30 @@ end
 
 module StackProf
   VERSION = '0.2.27'
+
+  # A child forked while profiling with `fork: :continue` keeps profiling,
+  # and writes its results when it exits, to the parent's `out` path with
+  # the child's pid added (see StackProf.results). Children forked to exec
+  # another program (system, spawn) don't come through here, and so aren't
+  # sampled.
+  module ForkHook
+    def _fork
+      pid = super
+      if pid == 0 && StackProf._fork_continue
+        at_exit do
+          StackProf.stop
+          StackProf.results
+        end
+      end
+      pid
+    end
+  end
+end
+
+if Process.respond_to?(:_fork)
+  Process.singleton_class.prepend(StackProf::ForkHook)
 end
 
 StackProf.autoload :Report, "stackprof/report.rb"
 StackProf.autoload :Middleware, "stackprof/middleware.rb"
+StackProf.autoload :Server, "stackprof/server.rb"
@@ -7,9 +7,18 @@ require 'json'
 module StackProf
   class Report
     MARSHAL_SIGNATURE = "\x04\x08"
+    INDEX_VERSION = 2
+    JSON_NUMERIC_KEY = /\A[0-9]*\z/
 
     class << self
-      def from_file(file)
+      # With +index+, a sidecar written by write_index is loaded instead when
+      # it is still current. It holds the aggregated frames and the report's
+      # precomputed sort orders, file totals and callers, but no raw samples.
+      def from_file(file, index: false)
+        if index and report = load_index(file)
+          return report
+        end
+
         File.open(file, 'rb') do |f|
           signature_bytes = f.read(2)
           f.rewind
@@ -25,21 +34,78 @@ module StackProf
         new(parse_json(json))
       end
 
-      def parse_json(json)
-        json.keys.each do |key|
-          value = json.delete(key)
-          from_json(value) if value.is_a?(Hash)
+      def index_path(file)
+        "#{file}.idx"
+      end
+
+      # Writes the sidecar index for the dump in +file+, see from_file.
+      def write_index(file)
+        index = {
+          version: INDEX_VERSION,
+          size: File.size(file),
+          mtime: File.mtime(file).to_r,
+          checksum: Digest::SHA256.file(file).hexdigest,
+          data: from_file(file).index_data,
+        }
+        File.binwrite(index_path(file), Marshal.dump(index))
+        index_path(file)
+      end
 
-          new_key = case key
-          when /\A[0-9]*\z/
-            key.to_i
+      # The index is current if it was built from a dump with the same size
+      # and mtime, or failing that (the dump was copied or touched) the same
+      # checksum.
+      def load_index(file)
+        path = index_path(file)
+        return unless File.exist?(path)
+
+        index = File.open(path, 'rb'){ |f| Marshal.load(f) }
+        return unless index.is_a?(Hash) && index[:version] == INDEX_VERSION
+        return unless index[:size] == File.size(file)
+        unless index[:mtime] == File.mtime(file).to_r
+          return unless index[:checksum] == Digest::SHA256.file(file).hexdigest
+        end
+
+        new(index[:data])
+      rescue TypeError, ArgumentError, EOFError
+        nil
+      end
+
+      # Converts the keys of a parsed JSON profile back to what the profiler
+      # returned: numeric keys to Integers, others to Symbols. Frames, which
+      # make up most of a profile, are rebuilt in one pass knowing their
+      # layout; anything else (metadata, labels) is converted recursively.
+      def parse_json(json)
+        json.each_with_object({}) do |(key, value), data|
+          key = json_key(key)
+          data[key] = if key == :frames && value.is_a?(Hash)
+            parse_json_frames(value)
+          elsif value.is_a?(Hash)
+            parse_json(value)
           else
-            key.to_sym
+            value
           end
+        end
+      end
+
+      private
+
+      def json_key(key)
+        key.match?(JSON_NUMERIC_KEY) ? key.to_i : key.to_sym
+      end
 
-          json[new_key] = value
+      def parse_json_frames(frames)
+        frames.each_with_object({}) do |(id, frame), hash|
+          frame = parse_json_counts(frame)
+          frame[:metrics] = frame[:metrics].to_h{ |name, counts| [name.to_sym, parse_json_counts(counts)] } if frame[:metrics]
+          hash[json_key(id)] = frame
         end
-        json
+      end
+
+      def parse_json_counts(counts)
+        counts = counts.transform_keys(&:to_sym)
+        counts[:edges] = counts[:edges].transform_keys{ |key| json_key(key) } if counts[:edges]
+        counts[:lines] = counts[:lines].transform_keys(&:to_i) if counts[:lines]
+        counts
       end
     end
 
@@ -53,6 +119,23 @@ module StackProf
         @data[:frames].sort_by{ |iseq, stats| -stats[sort_by_total ? :total_samples : :samples] }.inject({}){|h, (k, v)| h[k] = v; h}
     end
 
+    # Maps each frame name to the positions of its frames in #frames, so a
+    # name search matches each distinct name once instead of every frame.
+    def name_index
+      @data[:name_index] ||= frames.each_key.with_index.each_with_object({}) do |(addr, rank), hash|
+        (hash[@data[:frames][addr][:name]] ||= []) << rank
+      end
+    end
+
+    # The frames whose name matches +pattern+, in #frames order.
+    def frames_named(pattern)
+      ranks = name_index.each_with_object([]) do |(name, positions), matched|
+        matched.concat(positions) if name =~ pattern
+      end
+      ids = frames.keys
+      ranks.sort.map { |rank| ids[rank] }
+    end
+
     def normalized_frames
       id2hash = {}
       @data[:frames].each do |frame, info|
@@ -61,6 +144,9 @@ module StackProf
       @data[:frames].inject(Hash.new) do |hash, (frame, info)|
         info = hash[id2hash[frame.to_s]] = info.dup
         info[:edges] = info[:edges].inject(Hash.new){ |edges, (edge, weight)| edges[id2hash[edge.to_s]] = weight; edges } if info[:edges]
+        info[:metrics] = info[:metrics].transform_values do |counts|
+          counts[:edges] ? counts.merge(edges: counts[:edges].transform_keys{ |edge| id2hash[edge.to_s] }) : counts
+        end if info[:metrics]
         hash
       end
     end
@@ -70,7 +156,12 @@ module StackProf
     end
 
     def modeline
-      "#{@data[:mode]}(#{@data[:interval]})"
+      modeline = if @data[:event]
+        "#{@data[:mode]}(#{@data[:event]}:#{@data[:interval]})"
+      else
+        "#{@data[:mode]}(#{@data[:interval]})"
+      end
+      @data[:metric] ? "#{modeline}[#{@data[:metric]}]" : modeline
     end
 
     def overall_samples
@@ -93,6 +184,17 @@ module StackProf
       end
     end
 
+    # Sums two sets of frame counts (samples, total_samples, edges, lines).
+    def add_counts(a, b)
+      a.merge(b) do |key, x, y|
+        case key
+        when :edges then x.merge(y){ |_, m, n| m + n }
+        when :lines then x.merge(y){ |_, m, n| add_lines(m, n) }
+        else x + y
+        end
+      end
+    end
+
     def add_lines(a, b)
       return b if a.nil?
       return a+b if a.is_a? Integer
@@ -104,8 +206,20 @@ module StackProf
       pp @data
     end
 
+    # The profile without raw samples, with the lookups queries on it need
+    # already computed.
+    def index_data
+      frames(false)
+      frames(true)
+      files
+      callers
+      name_index
+      max_samples
+      @data.reject{ |k, v| k.to_s.start_with?("raw") }
+    end
+
     def print_dump(f=STDOUT)
-      f.puts Marshal.dump(@data.reject{|k,v| k == :files })
+      f.puts Marshal.dump(@data.reject{|k,v| k == :files || k == :callers || k == :name_index })
     end
 
     def print_json(f=STDOUT)
@@ -213,6 +327,93 @@ module StackProf
       f.puts %{{"x":#{x},"y":#{y},"width":#{weight},"frame_id":#{addr},"frame":#{frame[:name].dump},"file":#{frame[:file].dump}}}
     end
 
+    # Writes the raw samples as a speedscope "sampled" profile
+    # (https://www.speedscope.app/file-format-schema.json). The document is
+    # written as the raw buffer is walked, once for the samples and once for
+    # their weights, rather than built in memory first; the profile itself
+    # is still loaded whole.
+    def print_speedscope(f=STDOUT)
+      raise "profile does not include raw samples (add `raw: true` to collecting StackProf.run)" unless data[:raw]
+
+      frame_index = {}
+      f.print '{"$schema":"https://www.speedscope.app/file-format-schema.json",'
+      f.print %{"exporter":"stackprof #{VERSION}","name":#{modeline.to_json},}
+      f.print '"shared":{"frames":['
+      data[:frames].each_with_index do |(addr, frame), i|
+        frame_index[addr] = i
+        info = { name: frame[:name], file: frame[:file] }
+        info[:line] = frame[:line] if frame[:line]
+        f.print ',' if i > 0
+        f.print JSON.generate(info)
+      end
+      f.print ']},"profiles":['
+
+      unit = data[:raw_timestamp_deltas] ? "microseconds" : "none"
+      f.print '{"type":"sampled",'
+      f.print %{"name":#{modeline.to_json},"unit":"#{unit}","startValue":0,"samples":[}
+
+      first = true
+      last_stack = last_json = nil
+      each_timeline_sample do |stack, _, _|
+        unless stack.equal?(last_stack)
+          last_stack = stack
+          last_json = "[#{stack.map{ |addr| frame_index[addr] }.join(',')}]"
+        end
+        f.print ',' unless first
+        first = false
+        f.print last_json
+      end
+
+      f.print '],"weights":['
+      first = true
+      total = 0
+      each_timeline_sample do |_, _, weight|
+        f.print ',' unless first
+        first = false
+        f.print weight
+        total += weight
+      end
+      f.print "],\"endValue\":#{total}}"
+      f.puts ']}'
+    end
+
+    # Writes the raw samples as Chrome trace events
+    # (chrome://tracing, Perfetto), one B/E pair per frame as it enters and
+    # leaves the stack. Like print_speedscope, events are written as the
+    # raw buffer is walked, keeping only the previous stack.
+    def print_chrome_trace(f=STDOUT)
+      raise "profile does not include raw samples (add `raw: true` to collecting StackProf.run)" unless data[:raw]
+      raise "profile does not include raw sample timestamps" unless timestamps = data[:raw_sample_timestamps]
+
+      names = Hash.new{ |h, addr| h[addr] = (frame = data[:frames][addr]) ? frame[:name].to_json : addr.to_s.to_json }
+      prev = []
+      start = timestamps.first || 0
+      ts = 0
+      first = true
+
+      event = lambda do |ph, addr|
+        f.print ',' unless first
+        first = false
+        f.print %{{"name":#{names[addr]},"cat":"stackprof","ph":"#{ph}","ts":#{ts},"pid":0,"tid":0}}
+      end
+
+      f.print '{"traceEvents":['
+      each_timeline_sample do |stack, n, _|
+        next if stack.equal?(prev)
+        ts = timestamps[n] - start
+
+        common = 0
+        common += 1 while common < prev.size && common < stack.size && prev[common] == stack[common]
+        (prev.size - 1).downto(common) { |i| event.call("E", prev[i]) }
+        (common...stack.size).each { |i| event.call("B", stack[i]) }
+        prev = stack
+      end
+
+      ts = timestamps.last - start + data[:interval].to_i unless timestamps.empty?
+      (prev.size - 1).downto(0) { |i| event.call("E", prev[i]) }
+      f.puts '],"displayTimeUnit":"ms"}'
+    end
+
     def convert_to_d3_flame_graph_format(name, stacks, depth)
       weight = 0
       children = []
@@ -254,6 +455,28 @@ module StackProf
       require "json"
       json = JSON.generate(convert_to_d3_flame_graph_format("<root>", stacks, 0), max_nesting: false)
 
+      print_d3_flamegraph_html(f, json)
+    end
+
+    # Differential flamegraph of +other+ against this profile (the baseline).
+    # Widths are +other+'s samples; colors show how much each node grew or
+    # shrank once the baseline is scaled to the same number of samples.
+    def print_d3_diff_flamegraph(other, f=STDOUT)
+      raise "profile does not include raw samples (add `raw: true` to collecting StackProf.run)" unless data[:raw] && other.data[:raw]
+
+      root = { children: {}, base: 0, value: 0 }
+      diff_flamegraph_tree(root, data, :base)
+      diff_flamegraph_tree(root, other.data, :value)
+
+      base_total, new_total = root[:base], root[:value]
+      scale = base_total > 0 ? new_total.to_f / base_total : 0
+
+      require "json"
+      json = JSON.generate(convert_diff_tree_to_d3_format("<root>", root, scale), max_nesting: false)
+      print_d3_flamegraph_html(f, json, true)
+    end
+
+    def print_d3_flamegraph_html(f, json, differential=false)
       # This html code is almost copied from d3-flame-graph sample code.
       # (Apache License 2.0)
       # https://github.com/spiermar/d3-flame-graph/blob/gh-pages/index.html
@@ -358,7 +581,7 @@ module StackProf
       //.sort(function(a,b){ return d3.descending(a.name, b.name);})
       .title("")
       .onClick(onClick)
-      .differential(false)
+      .differential(#{ differential })
       .selfValue(false);
 
 
@@ -415,6 +638,32 @@ module StackProf
       END
     end
 
+    def diff_flamegraph_tree(root, data, field)
+      raw = data[:raw]
+      names = Hash.new{ |h, addr| frame = data[:frames][addr]; h[addr] = "#{ frame[:name] } : #{ frame[:file] } : #{ frame[:line] }" }
+      idx = 0
+
+      while len = raw[idx]
+        weight = raw[idx + len + 1]
+        node = root
+        node[field] += weight
+        raw[idx + 1, len].each do |addr|
+          node = node[:children][names[addr]] ||= { children: {}, base: 0, value: 0 }
+          node[field] += weight
+        end
+        idx += len + 2
+      end
+    end
+
+    def convert_diff_tree_to_d3_format(name, node, scale)
+      {
+        "name" => name,
+        "value" => node[:value],
+        "delta" => (node[:value] - node[:base] * scale).round,
+        "children" => node[:children].map { |child_name, child| convert_diff_tree_to_d3_format(child_name, child, scale) },
+      }
+    end
+
     def print_graphviz(options = {}, f = STDOUT)
       if filter = options[:filter]
         mark_stack = []
@@ -482,6 +731,10 @@ module StackProf
       f.printf "  Mode: #{modeline}\n"
       f.printf "  Samples: #{@data[:samples]} (%.2f%% miss rate)\n", 100.0*@data[:missed_samples]/(@data[:missed_samples]+@data[:samples])
       f.printf "  GC: #{@data[:gc_samples]} (%.2f%%)\n", 100.0*@data[:gc_samples]/@data[:samples]
+      if states = @data[:thread_states]
+        f.printf "  GVL wait: #{states[:gvl_wait]} (%.2f%%)\n", 100.0*states[:gvl_wait]/@data[:samples]
+        f.printf "  Blocked: #{states[:blocked]} (%.2f%%)\n", 100.0*states[:blocked]/@data[:samples]
+      end
       f.puts "=================================="
       f.printf "% 10s    (pct)  % 10s    (pct)     FRAME\n" % ["TOTAL", "SAMPLES"]
       list = frames(sort_by_total)
@@ -529,8 +782,8 @@ module StackProf
 
     def print_method(name, f = STDOUT)
       name = /#{name}/ unless Regexp === name
-      frames.each do |frame, info|
-        next unless info[:name] =~ name
+      frames_named(name).each do |frame|
+        info = data[:frames][frame]
         file, line = info.values_at(:file, :line)
         line ||= 1
 
@@ -555,6 +808,7 @@ module StackProf
           end
         end
 
+        next if info[:native]
         f.puts "  code:"
         source_display(f, file, lines, line-1..maxline)
       end
@@ -572,7 +826,7 @@ module StackProf
         STDOUT.puts "\n\n"
 
         # Determine callers and callees for the current frame
-        new_frames  = frames.select  {|_, info| info[:name] =~ method_choice }
+        new_frames  = frames_named(method_choice).map {|frame| [frame, data[:frames][frame]] }
         new_choices = new_frames.map {|frame, info| [
           callers_for(frame).sort_by(&:last).reverse.map(&:first),
           (info[:edges] || []).map{ |k, w| [data[:frames][k][:name], w] }.sort_by{ |k,v| -v }.map(&:first)
@@ -619,6 +873,83 @@ module StackProf
       end
     end
 
+    # Label sets recorded with StackProf.with_labels, by id.
+    def label_sets
+      @data[:label_sets] || {}
+    end
+
+    # Returns a report of the raw samples whose labels match every entry of
+    # +criteria+; values are compared with ===, so a Regexp or a Range works
+    # as well as a literal.
+    def filter_by_labels(criteria)
+      raise "profile does not include raw sample labels (use StackProf.with_labels and `raw: true`)" unless set_ids = data[:raw_sample_label_sets]
+
+      matching = label_sets.each_with_object({}) do |(id, labels), hash|
+        hash[id] = true if criteria.all?{ |key, value| labels.key?(key) && value === labels[key] }
+      end
+      subprofile{ |n| matching[set_ids[n]] }
+    end
+
+    # Returns a report of the raw samples taken from +from_usec+ up to (but
+    # not including) +to_usec+ microseconds after the first sample, or until
+    # the end of the profile without +to_usec+.
+    def slice(from_usec, to_usec = nil)
+      raise "profile does not include raw sample timestamps (add `raw: true` to collecting StackProf.run)" unless timestamps = data[:raw_sample_timestamps]
+
+      start = timestamps.first || 0
+      first = timestamps.bsearch_index{ |t| t - start >= from_usec } || timestamps.size
+      last = to_usec && timestamps.bsearch_index{ |t| t - start >= to_usec } || timestamps.size
+      subprofile(first...[first, last].max)
+    end
+
+    # Splits the raw samples by the value of the +key+ label, returning a
+    # report per value. Samples without the label are grouped under nil.
+    def group_by_label(key)
+      raise "profile does not include raw sample labels (use StackProf.with_labels and `raw: true`)" unless set_ids = data[:raw_sample_label_sets]
+
+      values = label_sets.transform_values{ |labels| labels[key] }
+      values.values.uniq.each_with_object({}) do |value, hash|
+        report = subprofile{ |n| values[set_ids[n]] == value }
+        hash[value] = report if report.overall_samples > 0
+      end
+    end
+
+    # Names of the metrics recorded with StackProf.sample(weight, metric:).
+    def metrics
+      (@data[:metrics] || []).map(&:to_sym)
+    end
+
+    # Returns a report in which samples are counted by their weight under
+    # the +name+ metric instead of one each, so every report (text, graphs,
+    # flamegraphs) shows where that metric went.
+    def for_metric(name)
+      name = name.to_sym
+      raise ArgumentError, "profile has no #{name} metric (recorded with StackProf.sample(weight, metric: :#{name}))" unless metrics.include?(name)
+
+      frames = @data[:frames].each_with_object({}) do |(addr, frame), hash|
+        next unless counts = frame[:metrics] && frame[:metrics][name]
+        hash[addr] = frame.reject{ |key, _| key == :metrics || key == :edges || key == :lines }.merge!(counts)
+      end
+      data = {
+        version: version,
+        mode: @data[:mode],
+        interval: @data[:interval],
+        metric: name,
+        samples: frames.each_value.sum{ |frame| frame[:samples] },
+        gc_samples: 0,
+        missed_samples: 0,
+        metadata: @data[:metadata],
+        frames: frames,
+      }
+
+      if @data[:raw] && weights = @data[:raw_sample_weights] && @data[:raw_sample_weights][name]
+        data[:raw] = weighted_raw(@data[:raw], weights)
+        data[:raw_lines] = weighted_raw(@data[:raw_lines], weights) if @data[:raw_lines]
+      end
+
+      self.class.new(data)
+    end
+
     def +(other)
       raise ArgumentError, "cannot combine #{other.class}" unless self.class == other.class
       raise ArgumentError, "cannot combine #{modeline} with #{other.modeline}" unless modeline == other.modeline
@@ -645,6 +976,12 @@ module StackProf
               lines[line] = add_lines(lines[line], weight)
             end
           end
+          if f2[id][:metrics]
+            metrics = hash[id][:metrics] ||= {}
+            f2[id][:metrics].each do |name, counts|
+              metrics[name] = metrics[name] ? add_counts(metrics[name], counts) : counts
+            end
+          end
         else
           hash[id] = f1[id]
         end
@@ -661,18 +998,302 @@ module StackProf
         missed_samples: d1[:missed_samples] + d2[:missed_samples],
         frames: frames
       }
+      data[:event] = d1[:event] if d1[:event]
+      data[:metric] = d1[:metric] if d1[:metric]
+      data[:metrics] = metrics | other.metrics if d1[:metrics] || d2[:metrics]
+      if d1[:thread_states] && d2[:thread_states]
+        data[:thread_states] = d1[:thread_states].merge(d2[:thread_states]){ |_, a, b| a + b }
+      end
 
       self.class.new(data)
     end
 
+    # Compares +other+ against this profile (the baseline). Frames are matched
+    # by name, file and line, and counts are normalized to the fraction of
+    # each profile's samples, so captures of different length or interval can
+    # be compared. Deltas are in percentage points; the z-scores come from a
+    # two-proportion test on the sample counts (|z| > 2 is unlikely to be noise).
+    def diff(other)
+      raise ArgumentError, "cannot diff #{other.class}" unless self.class == other.class
+      raise ArgumentError, "cannot diff #{modeline} with #{other.modeline}" unless data[:mode] == other.data[:mode]
+
+      n1, n2 = overall_samples, other.overall_samples
+      {
+        base_samples: n1,
+        samples: n2,
+        methods: diff_entries(method_totals, other.method_totals, n1, n2) { |(name, file, line)| { name: name, file: file, line: line } },
+        lines: diff_entries(line_totals, other.line_totals, n1, n2) { |(file, line)| { file: file, line: line } },
+      }
+    end
+
+    def print_diff(other, sort_by_total=false, limit=nil, f = STDOUT)
+      result = diff(other)
+      key = sort_by_total ? :total_delta : :self_delta
+
+      f.puts "=================================="
+      f.printf "  Base: #{modeline} #{result[:base_samples]} samples\n"
+      f.printf "  New:  #{other.modeline} #{result[:samples]} samples\n"
+      f.puts "=================================="
+
+      methods = result[:methods].sort_by{ |entry| -entry[key].abs }
+      methods = methods.first(limit) if limit
+      f.printf "% 8s % 8s % 9s % 7s     %s\n", "BASE", "NEW", "DELTA", "Z", sort_by_total ? "FRAME (total)" : "FRAME (self)"
+      methods.each do |entry|
+        print_diff_entry(f, entry, sort_by_total, result, entry[:name])
+      end
+
+      lines = result[:lines].sort_by{ |entry| -entry[key].abs }
+      lines = lines.first(limit) if limit
+      f.puts
+      f.printf "% 8s % 8s % 9s % 7s     %s\n", "BASE", "NEW", "DELTA", "Z", sort_by_total ? "LINE (total)" : "LINE (self)"
+      lines.each do |entry|
+        print_diff_entry(f, entry, sort_by_total, result, "#{entry[:file]}:#{entry[:line]}")
+      end
+    end
+
+    protected
+    def method_totals
+      @data[:frames].each_value.with_object({}) do |frame, hash|
+        totals = hash[[frame[:name], frame[:file], frame[:line]]] ||= [0, 0]
+        totals[0] += frame[:samples]
+        totals[1] += frame[:total_samples]
+      end
+    end
+
+    def line_totals
+      files.each_with_object({}) do |(file, lines), hash|
+        lines.each do |line, weight|
+          total, samples = weight.is_a?(Array) ? weight : [weight, weight]
+          hash[[file, line]] = [samples, total]
+        end
+      end
+    end
+
     private
+    # Builds a new report from the raw samples for which the block, given
+    # each sample's number (its index in per-sample arrays such as
+    # :raw_sample_timestamps), returns true. Frames, edges, lines and thread
+    # state counts are recomputed the same way the sampler aggregates them.
+    # With +range+, only the samples numbered within it are considered, and
+    # the raw entries outside of it are skipped without being read.
+    def subprofile(range = nil)
+      raw, raw_lines = data[:raw], data[:raw_lines]
+      per_sample = [:raw_sample_timestamps, :raw_timestamp_deltas, :raw_sample_label_sets].select{ |key| data[key] }
+      sub = {
+        version: version,
+        mode: data[:mode],
+        interval: data[:interval],
+        samples: 0,
+        gc_samples: 0,
+        missed_samples: 0,
+        metadata: data[:metadata],
+        frames: {},
+        raw: [],
+      }
+      sub[:raw_lines] = [] if raw_lines
+      sub[:thread_states] = { running: 0, gvl_wait: 0, blocked: 0 } if data[:thread_states]
+      per_sample.each{ |key| sub[key] = [] }
+      sub[:label_sets] = data[:label_sets] if data[:label_sets]
+      if weights = data[:raw_sample_weights]
+        sub[:metrics] = data[:metrics]
+        sub[:raw_sample_weights] = weights.transform_values{ [] }
+      end
+
+      idx = n = 0
+      if range
+        offsets, firsts = raw_index
+        if entry = (firsts.bsearch_index{ |first| first > range.begin } || firsts.size) - 1 and entry >= 0
+          idx, n = offsets[entry], firsts[entry]
+        end
+      end
+
+      while len = raw[idx]
+        break if range && n >= range.end
+        count = raw[idx + len + 1]
+        selected = 0
+        selected_weights = weights && Hash.new(0)
+        count.times do |i|
+          next if range && !range.cover?(n + i)
+          next if block_given? && !yield(n + i)
+          selected += 1
+          per_sample.each{ |key| sub[key] << data[key][n + i] }
+          weights.each do |name, values|
+            sub[:raw_sample_weights][name] << values[n + i]
+            selected_weights[name] += values[n + i]
+          end if weights
+        end
+
+        if selected > 0
+          stack = raw[idx + 1, len]
+          lines = raw_lines && raw_lines[idx + 1, len]
+          sub[:raw] << len
+          sub[:raw].concat(stack) << selected
+          if lines
+            sub[:raw_lines] << len
+            sub[:raw_lines].concat(lines) << selected
+          end
+          add_stack(sub[:frames], stack, lines, selected)
+          if states = sub[:thread_states] and state = thread_state(stack)
+            states[state] += selected
+          end
+          selected_weights.each do |name, weight|
+            add_stack(sub[:frames], stack, lines, weight, name) if weight > 0
+          end if weights
+          sub[:samples] += selected
+        end
+
+        n += count
+        idx += len + 2
+      end
+
+      gc = sub[:frames].each_value.find{ |frame| frame[:name] == "(garbage collection)" }
+      sub[:gc_samples] = gc[:total_samples] if gc
+
+      self.class.new(sub)
+    end
+
+    # The thread state a raw stack was sampled in, from the fake frame at
+    # its leaf, or nil for GC samples, which aren't counted in a state.
+    def thread_state(stack)
+      case data[:frames][stack.last][:name]
+      when "(waiting for GVL)" then :gvl_wait
+      when "(blocked)" then :blocked
+      else :running unless data[:frames][stack.first][:name] == "(garbage collection)"
+      end
+    end
+
+    # The raw entries (of :raw or :raw_lines) with each count replaced by
+    # the sum of +weights+ of its samples, leaving out those that add to 0.
+    def weighted_raw(raw, weights)
+      weighted = []
+      idx = n = 0
+      while len = raw[idx]
+        count = raw[idx + len + 1]
+        weight = weights[n, count].sum
+        weighted.push(len).concat(raw[idx + 1, len]).push(weight) if weight > 0
+        n += count
+        idx += len + 2
+      end
+      weighted
+    end
+
+    # Offsets of the entries in :raw, and the number of the first sample of
+    # each, for finding the entry a sample belongs to with a binary search.
+    def raw_index
+      @raw_index ||= begin
+        raw = data[:raw]
+        offsets, firsts = [], []
+        idx = n = 0
+        while len = raw[idx]
+          offsets << idx
+          firsts << n
+          n += raw[idx + len + 1]
+          idx += len + 2
+        end
+        [offsets, firsts]
+      end
+    end
+
+    # Adds +weight+ samples of +stack+ (root first, as in :raw) to +frames+,
+    # or to their counts under +metric+.
+    def add_stack(frames, stack, lines, weight, metric = nil)
+      leaf = stack.size - 1
+      seen = {}
+
+      stack.each_with_index do |addr, i|
+        frame = frames[addr] ||= data[:frames][addr].select{ |key, _| key == :name || key == :file || key == :line }.merge!(samples: 0, total_samples: 0)
+        frame = (frame[:metrics] ||= {})[metric] ||= { samples: 0, total_samples: 0 } if metric
+
+        frame[:total_samples] += weight unless seen[addr]
+        seen[addr] = true
+
+        if i == leaf
+          frame[:samples] += weight
+        else
+          edges = frame[:edges] ||= {}
+          edges[stack[i + 1]] = (edges[stack[i + 1]] || 0) + weight
+        end
+
+        if lines && (line = lines[i]) > 0
+          frame_lines = frame[:lines] ||= {}
+          total, samples = frame_lines[line] || [0, 0]
+          frame_lines[line] = [total + weight, i == leaf ? samples + weight : samples]
+        end
+      end
+    end
+
+    def diff_entries(base, other, n1, n2)
+      (base.keys | other.keys).map do |key|
+        s1, t1 = base[key] || [0, 0]
+        s2, t2 = other[key] || [0, 0]
+        yield(key).merge!(
+          base_samples: s1,
+          base_total_samples: t1,
+          samples: s2,
+          total_samples: t2,
+          self_delta: percent(s2, n2) - percent(s1, n1),
+          total_delta: percent(t2, n2) - percent(t1, n1),
+          self_z: z_score(s1, n1, s2, n2),
+          total_z: z_score(t1, n1, t2, n2),
+        )
+      end
+    end
+
+    def print_diff_entry(f, entry, sort_by_total, result, label)
+      if sort_by_total
+        base, new, delta, z = entry.values_at(:base_total_samples, :total_samples, :total_delta, :total_z)
+      else
+        base, new, delta, z = entry.values_at(:base_samples, :samples, :self_delta, :self_z)
+      end
+      f.printf "% 7.1f%% % 7.1f%% % +8.1f%% % 7.1f     %s\n", percent(base, result[:base_samples]), percent(new, result[:samples]), delta, z, label
+    end
+
+    def percent(count, total)
+      total > 0 ? 100.0 * count / total : 0.0
+    end
+
+    def z_score(x1, n1, x2, n2)
+      return 0.0 if n1 == 0 || n2 == 0
+      x1, x2 = [x1, n1].min, [x2, n2].min
+      p = (x1 + x2).to_f / (n1 + n2)
+      se = Math.sqrt(p * (1 - p) * (1.0 / n1 + 1.0 / n2))
+      se > 0 ? (x2.to_f / n2 - x1.to_f / n1) / se : 0.0
+    end
+
+    # Yields every sample in the raw buffer in recording order, expanding
+    # the run-length encoding: the stack (root first, shared between
+    # repeats), the sample number, its weight in microseconds when deltas
+    # were recorded (1 otherwise).
+    def each_timeline_sample
+      raw = data[:raw]
+      deltas = data[:raw_timestamp_deltas]
+      idx = n = 0
+
+      while len = raw[idx]
+        stack = raw[idx + 1, len]
+        count = raw[idx + len + 1]
+        idx += len + 2
+        count.times do
+          yield stack, n, (deltas ? deltas[n] : 1)
+          n += 1
+        end
+      end
+    end
+
     def root_frames
       frames.select{ |addr, frame| callers_for(addr).size == 0  }
     end
 
+    def callers
+      @data[:callers] ||= data[:frames].each_with_object({}) do |(id, other), hash|
+        other[:edges].each do |addr, weight|
+          (hash[addr] ||= []) << [other[:name], weight]
+        end if other[:edges]
+      end
+    end
+
     def callers_for(addr)
-      @callers_for ||= {}
-      @callers_for[addr] ||= data[:frames].map{ |id, other| [other[:name], other[:edges][addr]] if other[:edges] && other[:edges].include?(addr) }.compact
+      callers[addr] || []
     end
 
     def source_display(f, file, lines, range=nil)
@@ -0,0 +1,259 @@
+require 'socket'
+require 'json'
+require 'uri'
+
+module StackProf
+  # Serves a raw profile to a browser without sending it the whole profile:
+  # the call tree is aggregated here, for the time range and name filter
+  # being looked at, and only the nodes visible from the current zoom level
+  # (a few levels deep, above a minimum share of samples) are sent.
+  #
+  #   $ stackprof serve tmp/stackprof-cpu-myapp.dump
+  class Server
+    # Number of aggregated trees (one per time range and filter) to keep.
+    CACHE_SIZE = 4
+
+    REASONS = { 200 => 'OK', 400 => 'Bad Request', 404 => 'Not Found', 405 => 'Method Not Allowed' }
+
+    def initialize(report, host: '127.0.0.1', port: 8888)
+      raise ArgumentError, "profile does not include raw samples (add `raw: true` to collecting StackProf.run)" unless report.data[:raw]
+
+      @report = report
+      @host = host
+      @port = port
+      @trees = {}
+    end
+
+    def start
+      server = TCPServer.new(@host, @port)
+      STDERR.puts "stackprof: serving #{@report.modeline} on http://#{@host}:#{server.addr[1]}/"
+      loop do
+        client = server.accept
+        begin
+          handle(client)
+        rescue SystemCallError, IOError
+        ensure
+          client.close
+        end
+      end
+    ensure
+      server.close if server
+    end
+
+    # Returns the status, content type and body for a GET of +path+.
+    def call(path, params = {})
+      case path
+      when '/'
+        [200, 'text/html; charset=utf-8', VIEWER]
+      when '/info'
+        [200, 'application/json', JSON.generate(info)]
+      when '/tree'
+        [200, 'application/json', JSON.generate(tree(params))]
+      else
+        [404, 'application/json', JSON.generate(error: "not found")]
+      end
+    rescue ArgumentError, RegexpError => e
+      [400, 'application/json', JSON.generate(error: e.message)]
+    end
+
+    def info
+      timestamps = @report.data[:raw_sample_timestamps]
+      {
+        mode: @report.modeline,
+        samples: @report.overall_samples,
+        duration_usec: timestamps && timestamps.any? ? timestamps.last - timestamps.first : nil,
+      }
+    end
+
+    # The call tree below +path+ (comma separated frame ids from the root),
+    # +depth+ levels deep, leaving out nodes with less than +min+ of its
+    # samples. +filter+ keeps the samples with a frame whose name matches
+    # it; +from+ and +to+ are microseconds since the first sample.
+    def tree(params)
+      root = call_tree(params['from'], params['to'], params['filter'])
+      path = params['path'].to_s.split(',').map{ |id| Integer(id) }
+      depth = Integer(params['depth'] || 10)
+      min = Float(params['min'] || 0.001)
+
+      node = path.inject(root){ |parent, id| parent[3][id] or raise ArgumentError, "no such node: #{path.join(',')}" }
+      node_json(node, path, depth, [node[1] * min, 1].max)
+    end
+
+    private
+
+    def handle(client)
+      request_line = client.gets or return
+      method, target = request_line.split(' ')
+      while (line = client.gets) && line != "\r\n"
+      end
+
+      if method == 'GET'
+        path, query = target.to_s.split('?', 2)
+        status, type, body = call(path, URI.decode_www_form(query || '').to_h)
+      else
+        status, type, body = 405, 'text/plain', 'method not allowed'
+      end
+
+      client.write "HTTP/1.1 #{status} #{REASONS[status]}\r\nContent-Type: #{type}\r\nContent-Length: #{body.bytesize}\r\nConnection: close\r\n\r\n"
+      client.write body
+    end
+
+    # Nodes are [frame id, total samples, self samples, children by id].
+    def call_tree(from, to, filter)
+      key = [from, to, filter]
+      @trees[key] ||= begin
+        @trees.shift if @trees.size >= CACHE_SIZE
+        report = from || to ? @report.slice(Integer(from || 0), to && Integer(to)) : @report
+        build_tree(report.data[:raw], filter && Regexp.new(filter))
+      end
+    end
+
+    def build_tree(raw, filter)
+      frames = @report.data[:frames]
+      matching = filter && frames.each_with_object({}){ |(id, frame), hash| hash[id] = true if frame[:name] =~ filter }
+      root = [nil, 0, 0, {}]
+
+      idx = 0
+      while len = raw[idx]
+        weight = raw[idx + len + 1]
+        stack = raw[idx + 1, len]
+        idx += len + 2
+        next if matching && stack.none?{ |id| matching[id] }
+
+        node = root
+        root[1] += weight
+        stack.each do |id|
+          node = node[3][id] ||= [id, 0, 0, {}]
+          node[1] += weight
+        end
+        node[2] += weight
+      end
+
+      root
+    end
+
+    def node_json(node, path, depth, min_total)
+      id, total, samples, children = node
+      frame = id ? @report.data[:frames][id] : { name: "(all)", file: "" }
+      json = { path: path, name: frame[:name], file: frame[:file], line: frame[:line], total: total, samples: samples }
+
+      visible = children.values.select{ |child| child[1] >= min_total }
+      json[:more] = depth == 0 ? children.any? : visible.size < children.size
+      json[:children] = depth == 0 ? [] : visible.sort_by{ |child| -child[1] }.map{ |child| node_json(child, path + [child[0]], depth - 1, min_total) }
+      json
+    end
+
+    VIEWER = <<-'END'
+<!DOCTYPE html>
+<html>
+<head>
+<meta charset="utf-8">
+<title>stackprof</title>
+<style>
+  body { font: 12px sans-serif; margin: 10px; }
+  #controls input { width: 90px; }
+  #controls input[name=filter] { width: 200px; }
+  #crumbs a { cursor: pointer; color: #06c; }
+  #chart { position: relative; margin-top: 10px; }
+  .node { position: absolute; height: 17px; overflow: hidden; white-space: nowrap; box-sizing: border-box;
+          border: 1px solid #fff; padding: 1px 3px; cursor: pointer; }
+  .node.more { border-bottom: 2px dashed #555; }
+</style>
+</head>
+<body>
+<div id="info"></div>
+<form id="controls">
+  filter <input name="filter" placeholder="name regexp">
+  from <input name="from" placeholder="ms"> to <input name="to" placeholder="ms">
+  <button>apply</button>
+</form>
+<div id="crumbs"></div>
+<div id="chart"></div>
+<script>
+var state = { path: [], filter: '', from: '', to: '' };
+var depth = 12;
+
+function query(params) {
+  return Object.keys(params).filter(function(k) { return params[k] !== ''; })
+    .map(function(k) { return k + '=' + encodeURIComponent(params[k]); }).join('&');
+}
+
+function color(name) {
+  var h = 0;
+  for (var i = 0; i < name.length; i++) h = (h * 31 + name.charCodeAt(i)) % 360;
+  return 'hsl(' + h + ',60%,75%)';
+}
+
+function load() {
+  var params = { path: state.path.join(','), depth: depth, filter: state.filter,
+                 from: state.from === '' ? '' : Math.round(state.from * 1000),
+                 to: state.to === '' ? '' : Math.round(state.to * 1000) };
+  fetch('/tree?' + query(params)).then(function(r) { return r.json(); }).then(function(root) {
+    var chart = document.getElementById('chart');
+    chart.innerHTML = '';
+    if (root.error) { chart.textContent = root.error; return; }
+    crumbs(root);
+    var rows = draw(chart, root, 0, 100, 0, root.total);
+    chart.style.height = (rows * 17) + 'px';
+  });
+}
+
+function draw(chart, node, left, width, row, total) {
+  var div = document.createElement('div');
+  div.className = 'node' + (node.more ? ' more' : '');
+  div.style.left = left + '%';
+  div.style.width = width + '%';
+  div.style.top = (row * 17) + 'px';
+  div.style.background = color(node.name);
+  div.textContent = node.name;
+  div.title = node.name + ' ' + node.file + (node.line ? ':' + node.line : '') + '\n' +
+    node.total + ' total (' + (100 * node.total / total).toFixed(1) + '%), ' + node.samples + ' self';
+  div.onclick = function() { state.path = node.path; load(); };
+  chart.appendChild(div);
+
+  var rows = row + 1, x = left;
+  node.children.forEach(function(child) {
+    var w = width * child.total / node.total;
+    rows = Math.max(rows, draw(chart, child, x, w, row + 1, total));
+    x += w;
+  });
+  return rows;
+}
+
+function crumbs(root) {
+  var el = document.getElementById('crumbs');
+  el.innerHTML = '';
+  var all = document.createElement('a');
+  all.textContent = '(all)';
+  all.onclick = function() { state.path = []; load(); };
+  el.appendChild(all);
+  if (state.path.length > 0) {
+    var up = document.createElement('a');
+    up.textContent = ' ↑ up';
+    up.onclick = function() { state.path = state.path.slice(0, -1); load(); };
+    el.appendChild(up);
+    el.appendChild(document.createTextNode(' / ' + root.name));
+  }
+}
+
+document.getElementById('controls').onsubmit = function(e) {
+  e.preventDefault();
+  var form = e.target;
+  state.filter = form.filter.value;
+  state.from = form.from.value;
+  state.to = form.to.value;
+  state.path = [];
+  load();
+};
+
+fetch('/info').then(function(r) { return r.json(); }).then(function(info) {
+  document.getElementById('info').textContent = info.mode + ', ' + info.samples + ' samples' +
+    (info.duration_usec ? ', ' + (info.duration_usec / 1000).toFixed(0) + ' ms' : '');
+});
+load();
+</script>
+</body>
+</html>
+    END
+  end
+end
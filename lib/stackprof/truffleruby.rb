@@ -25,6 +25,10 @@ module StackProf
       unimplemented
     end
 
+    def with_labels(labels)
+      yield
+    end
+
     def use_postponed_job!
       # noop
     end
@@ -0,0 +1,103 @@
+# Profiles shared by the Report and Server tests, written out by hand so
+# each test can state exactly which samples and frames it expects.
+module ProfileFixtures
+  private
+
+  # Two cpu mode frames, "a" calling "b".
+  def cpu_data
+    {
+      version: 1.2, mode: :cpu, interval: 1000, samples: 4, gc_samples: 0, missed_samples: 0,
+      frames: {
+        1 => { name: "a", file: "a.rb", line: 1, total_samples: 4, samples: 1, edges: { 2 => 3 } },
+        2 => { name: "b", file: "b.rb", line: 1, total_samples: 3, samples: 3 },
+      },
+      raw: [2, 1, 2, 1],
+    }
+  end
+
+  # An aggregated-only cpu profile of +samples+ samples, with +frames+ from
+  # diff_frame.
+  def diff_data(samples, frames)
+    { version: 1.2, mode: :cpu, interval: 1000, samples: samples, frames: frames }
+  end
+
+  def diff_frame(name, samples, total, line = 10)
+    { name: name, file: "/a.rb", line: line, samples: samples, total_samples: total, lines: { line + 1 => [total, samples] } }
+  end
+
+  # Three samples with uneven timestamp deltas: main > foo twice, then main > bar.
+  def timeline_data
+    {
+      version: 1.2,
+      mode: :wall,
+      interval: 1000,
+      frames: {
+        1 => { name: "main", file: "a.rb", line: 1 },
+        2 => { name: "foo", file: "a.rb", line: 5 },
+        3 => { name: "bar", file: "a.rb" },
+      },
+      raw: [2, 1, 2, 2, 2, 1, 3, 1],
+      raw_sample_timestamps: [100, 112, 122],
+      raw_timestamp_deltas: [10, 12, 9],
+    }
+  end
+
+  # Five samples 100us apart: main > foo twice, then main > bar three times.
+  def timed_data
+    {
+      version: 1.2,
+      mode: :wall,
+      interval: 100,
+      samples: 5,
+      frames: {
+        1 => { name: "main", file: "a.rb", line: 1, samples: 0, total_samples: 5, edges: { 2 => 2, 3 => 3 } },
+        2 => { name: "foo", file: "a.rb", line: 5, samples: 2, total_samples: 2 },
+        3 => { name: "bar", file: "a.rb", line: 9, samples: 3, total_samples: 3 },
+      },
+      raw: [2, 1, 2, 2, 2, 1, 3, 3],
+      raw_sample_timestamps: [1100, 1200, 1300, 1400, 1500],
+      raw_timestamp_deltas: [100, 100, 100, 100, 100],
+    }
+  end
+
+  # Five samples with lines, four of them labeled with an endpoint.
+  def labeled_data
+    {
+      version: 1.2,
+      mode: :custom,
+      samples: 5,
+      frames: {
+        1 => { name: "main", file: "a.rb", line: 1, samples: 1, total_samples: 5, edges: { 2 => 4 } },
+        2 => { name: "foo", file: "a.rb", line: 5, samples: 4, total_samples: 4 },
+      },
+      raw: [2, 1, 2, 4, 1, 1, 1],
+      raw_lines: [2, 3, 6, 4, 1, 3, 1],
+      label_sets: { 0 => {}, 1 => { endpoint: "a" }, 2 => { endpoint: "b", db: "x" } },
+      raw_sample_label_sets: [1, 1, 2, 0, 1],
+    }
+  end
+
+  # Three samples, the two in foo weighted with a :db_ms metric.
+  def weighted_data
+    {
+      version: 1.2,
+      mode: :custom,
+      samples: 3,
+      gc_samples: 0,
+      missed_samples: 0,
+      metrics: [:db_ms],
+      frames: {
+        1 => { name: "main", file: "a.rb", line: 1, samples: 0, total_samples: 3, edges: { 2 => 2, 3 => 1 }, lines: { 2 => [3, 0] },
+               metrics: { db_ms: { total_samples: 12, samples: 0, edges: { 2 => 12 }, lines: { 2 => [12, 0] } } } },
+        2 => { name: "foo", file: "a.rb", line: 5, samples: 2, total_samples: 2, lines: { 6 => [2, 2] },
+               metrics: { db_ms: { total_samples: 12, samples: 12, lines: { 6 => [12, 12] } } } },
+        3 => { name: "bar", file: "a.rb", line: 9, samples: 1, total_samples: 1 },
+      },
+      raw: [2, 1, 2, 2, 2, 1, 3, 1],
+      raw_lines: [2, 2, 6, 2, 2, 2, 0, 1],
+      raw_sample_timestamps: [100, 200, 300],
+      raw_timestamp_deltas: [100, 100, 100],
+      raw_sample_weights: { db_ms: [5, 7, 0] },
+    }
+  end
+end
@@ -1,6 +1,7 @@
 $:.unshift File.expand_path('../../lib', __FILE__)
 require 'stackprof'
 require 'minitest/autorun'
+require_relative 'profile_fixtures'
 
 class ReportDumpTest < Minitest::Test
   require 'stringio'
@@ -50,9 +51,259 @@ class ReportReadTest < Minitest::Test
     assert_equal({ mode: "cpu" }, report.data)
   end
 
+  def test_from_json_restores_key_types
+    profile = {
+      version: 1.2,
+      mode: "cpu",
+      metadata: { app: "x", build: { 1 => "a" } },
+      frames: {
+        140001 => { name: "a", file: "a.rb", line: 1, total_samples: 3, samples: 1, edges: { 140002 => 2 }, lines: { 2 => [3, 1] } },
+        140002 => { name: "b", file: "a.rb", line: 5, total_samples: 2, samples: 2, lines: { 6 => [2, 2] } },
+      },
+      raw: [2, 140001, 140002, 2],
+    }
+    report = StackProf::Report.from_json(JSON.parse(JSON.generate(profile)))
+
+    assert_equal profile, report.data
+  end
+
   private
 
   def fixture(name)
     Pathname.new(__dir__).join("fixtures", name)
   end
 end
+
+class ReportIndexTest < Minitest::Test
+  include ProfileFixtures
+
+  require 'stringio'
+  require 'tmpdir'
+
+  def test_index_answers_queries_without_raw_samples
+    Dir.mktmpdir do |dir|
+      file = File.join(dir, "profile.dump")
+      File.binwrite(file, Marshal.dump(cpu_data))
+      StackProf::Report.write_index(file)
+
+      report = StackProf::Report.from_file(file, index: true)
+      refute report.data.key?(:raw)
+      assert_equal text(StackProf::Report.from_file(file)), text(report)
+      assert_equal [["a", 3]], report.send(:callers_for, 2)
+    end
+  end
+
+  def test_index_holds_frame_names
+    Dir.mktmpdir do |dir|
+      file = File.join(dir, "profile.dump")
+      File.binwrite(file, Marshal.dump(cpu_data))
+      StackProf::Report.write_index(file)
+
+      report = StackProf::Report.from_file(file, index: true)
+      assert_equal({ "b" => [0], "a" => [1] }, report.data[:name_index])
+      assert_equal [2, 1], report.send(:frames_named, /a|b/)
+      assert_equal [1], report.send(:frames_named, /a/)
+    end
+  end
+
+  def test_stale_index_is_ignored
+    Dir.mktmpdir do |dir|
+      file = File.join(dir, "profile.dump")
+      File.binwrite(file, Marshal.dump(cpu_data))
+      StackProf::Report.write_index(file)
+      File.binwrite(file, Marshal.dump(cpu_data.merge(samples: 5)))
+
+      assert_equal 5, StackProf::Report.from_file(file, index: true).overall_samples
+    end
+  end
+
+  private
+
+  def text(report)
+    f = StringIO.new
+    report.print_text(false, nil, nil, nil, nil, nil, f)
+    f.string
+  end
+end
+
+class ReportTimelineTest < Minitest::Test
+  include ProfileFixtures
+
+  require 'stringio'
+
+  def test_speedscope
+    f = StringIO.new
+    StackProf::Report.new(timeline_data).print_speedscope(f)
+    json = JSON.parse(f.string)
+
+    assert_equal %w[main foo bar], json["shared"]["frames"].map { |frame| frame["name"] }
+    profile = json["profiles"].first
+    assert_equal "sampled", profile["type"]
+    assert_equal "microseconds", profile["unit"]
+    assert_equal [[0, 1], [0, 1], [0, 2]], profile["samples"]
+    assert_equal [10, 12, 9], profile["weights"]
+    assert_equal 31, profile["endValue"]
+  end
+
+  def test_chrome_trace
+    f = StringIO.new
+    StackProf::Report.new(timeline_data).print_chrome_trace(f)
+    events = JSON.parse(f.string)["traceEvents"]
+
+    assert_equal [["B", "main", 0], ["B", "foo", 0], ["E", "foo", 22], ["B", "bar", 22], ["E", "bar", 1022], ["E", "main", 1022]],
+      events.map { |e| [e["ph"], e["name"], e["ts"]] }
+  end
+end
+
+class ReportDiffTest < Minitest::Test
+  include ProfileFixtures
+
+  require 'stringio'
+
+  def test_diff_matches_frames_by_name_and_normalizes
+    base = StackProf::Report.new(diff_data(100, { 1 => diff_frame("A#foo", 50, 80), 2 => diff_frame("A#bar", 50, 50, 20) }))
+    other = StackProf::Report.new(diff_data(200, { 7 => diff_frame("A#foo", 160, 180), 8 => diff_frame("A#baz", 40, 40, 30) }))
+
+    result = base.diff(other)
+    methods = result[:methods].to_h { |entry| [entry[:name], entry] }
+
+    assert_equal 100, result[:base_samples]
+    assert_equal 200, result[:samples]
+    assert_in_delta 30.0, methods["A#foo"][:self_delta]
+    assert_in_delta 10.0, methods["A#foo"][:total_delta]
+    assert_in_delta(-50.0, methods["A#bar"][:self_delta])
+    assert_in_delta 20.0, methods["A#baz"][:self_delta]
+    assert_operator methods["A#foo"][:self_z], :>, 2
+    assert_operator methods["A#bar"][:self_z], :<, -2
+
+    lines = result[:lines].to_h { |entry| [entry[:line], entry] }
+    assert_in_delta 30.0, lines[11][:self_delta]
+  end
+
+  def test_diff_rejects_other_modes
+    base = StackProf::Report.new(diff_data(1, {}))
+    other = StackProf::Report.new(diff_data(1, {}).merge(mode: :wall))
+    assert_raises(ArgumentError) { base.diff(other) }
+  end
+
+  def test_print_diff
+    base = StackProf::Report.new(diff_data(100, { 1 => diff_frame("A#foo", 50, 80) }))
+    other = StackProf::Report.new(diff_data(200, { 1 => diff_frame("A#foo", 160, 180) }))
+    f = StringIO.new
+    base.print_diff(other, false, nil, f)
+
+    assert_match(/50\.0%\s+80\.0%\s+\+30\.0%\s+[\d.]+\s+A#foo/, f.string)
+  end
+end
+
+class ReportLabelsTest < Minitest::Test
+  include ProfileFixtures
+
+  def test_filter_by_labels
+    report = StackProf::Report.new(labeled_data).filter_by_labels(endpoint: "a")
+
+    assert_equal 3, report.overall_samples
+    assert_equal [2, 1, 2, 2, 1, 1, 1], report.data[:raw]
+    assert_equal [1, 1, 1], report.data[:raw_sample_label_sets]
+    assert_equal({ name: "main", file: "a.rb", line: 1, samples: 1, total_samples: 3, edges: { 2 => 2 }, lines: { 3 => [3, 1] } }, report.data[:frames][1])
+    assert_equal({ name: "foo", file: "a.rb", line: 5, samples: 2, total_samples: 2, lines: { 6 => [2, 2] } }, report.data[:frames][2])
+  end
+
+  def test_filter_by_labels_with_regexp
+    report = StackProf::Report.new(labeled_data).filter_by_labels(endpoint: /\A[ab]\z/)
+    assert_equal 4, report.overall_samples
+  end
+
+  def test_group_by_label
+    groups = StackProf::Report.new(labeled_data).group_by_label(:endpoint)
+
+    assert_equal [nil, "a", "b"], groups.keys.sort_by(&:to_s)
+    assert_equal 3, groups["a"].overall_samples
+    assert_equal 1, groups["b"].overall_samples
+    assert_equal 1, groups[nil].overall_samples
+  end
+end
+
+class ReportSliceTest < Minitest::Test
+  include ProfileFixtures
+
+  def test_slice
+    report = StackProf::Report.new(timed_data).slice(100, 300)
+
+    assert_equal 2, report.overall_samples
+    assert_equal [2, 1, 2, 1, 2, 1, 3, 1], report.data[:raw]
+    assert_equal [1200, 1300], report.data[:raw_sample_timestamps]
+    assert_equal({ 2 => 1, 3 => 1 }, report.data[:frames][1][:edges])
+    assert_equal 1, report.data[:frames][2][:samples]
+  end
+
+  def test_slice_to_end
+    report = StackProf::Report.new(timed_data).slice(250)
+
+    assert_equal 2, report.overall_samples
+    assert_equal [2, 1, 3, 2], report.data[:raw]
+    assert_nil report.data[:frames][2]
+  end
+
+  def test_slice_recounts_thread_states
+    data = timed_data.merge(thread_states: { running: 2, gvl_wait: 0, blocked: 3 })
+    data[:frames][3] = data[:frames][3].merge(name: "(blocked)")
+    report = StackProf::Report.new(data).slice(100, 300)
+
+    assert_equal({ running: 1, gvl_wait: 0, blocked: 1 }, report.data[:thread_states])
+  end
+
+  def test_slice_outside_profile
+    assert_equal 0, StackProf::Report.new(timed_data).slice(1000, 2000).overall_samples
+  end
+
+  def test_slice_requires_timestamps
+    assert_raises(RuntimeError) do
+      StackProf::Report.new(timed_data.reject{ |k, _| k == :raw_sample_timestamps }).slice(0, 100)
+    end
+  end
+end
+
+class ReportMetricTest < Minitest::Test
+  include ProfileFixtures
+
+  def test_for_metric
+    report = StackProf::Report.new(weighted_data).for_metric(:db_ms)
+
+    assert_equal "custom()[db_ms]", report.modeline
+    assert_equal 12, report.overall_samples
+    assert_equal({ name: "foo", file: "a.rb", line: 5, samples: 12, total_samples: 12, lines: { 6 => [12, 12] } }, report.data[:frames][2])
+    assert_nil report.data[:frames][3]
+    assert_equal [2, 1, 2, 12], report.data[:raw]
+    assert_equal [2, 2, 6, 12], report.data[:raw_lines]
+  end
+
+  def test_for_unknown_metric
+    assert_raises(ArgumentError) { StackProf::Report.new(weighted_data).for_metric(:bytes) }
+  end
+
+  def test_subprofile_keeps_weights
+    report = StackProf::Report.new(weighted_data).slice(50)
+
+    assert_equal({ db_ms: [7, 0] }, report.data[:raw_sample_weights])
+    assert_equal({ total_samples: 7, samples: 0, edges: { 2 => 7 }, lines: { 2 => [7, 0] } }, report.data[:frames][1][:metrics][:db_ms])
+    assert_equal 7, report.for_metric(:db_ms).overall_samples
+  end
+
+  def test_merge
+    report = StackProf::Report.new(weighted_data)
+    merged = report + report
+
+    assert_equal [:db_ms], merged.metrics
+    assert_equal 24, merged.for_metric(:db_ms).overall_samples
+    assert_equal [24], merged.for_metric(:db_ms).data[:frames].values.first[:edges].values
+  end
+
+  def test_json
+    expected = StackProf::Report.new(weighted_data).for_metric(:db_ms)
+    report = StackProf::Report.from_json(JSON.parse(JSON.generate(weighted_data))).for_metric("db_ms")
+
+    assert_equal expected.data[:frames], report.data[:frames]
+    assert_equal expected.data[:raw], report.data[:raw]
+  end
+end
@@ -0,0 +1,77 @@
+$:.unshift File.expand_path('../../lib', __FILE__)
+require 'stackprof'
+require 'stackprof/server'
+require 'minitest/autorun'
+require 'json'
+require_relative 'profile_fixtures'
+
+class StackProf::ServerTest < Minitest::Test
+  include ProfileFixtures
+
+  def test_tree
+    tree = get('/tree', 'depth' => '2')
+
+    assert_equal "(all)", tree["name"]
+    assert_equal 5, tree["total"]
+    assert_equal [["foo", [1, 2], 2], ["bar", [1, 3], 3]], tree["children"][0]["children"].map { |n| [n["name"], n["path"], n["total"]] }.sort_by(&:last)
+  end
+
+  def test_tree_zoom_and_depth
+    tree = get('/tree', 'path' => '1', 'depth' => '0')
+
+    assert_equal "main", tree["name"]
+    assert_equal [], tree["children"]
+    assert tree["more"]
+  end
+
+  def test_tree_drops_small_nodes
+    tree = get('/tree', 'path' => '1', 'min' => '0.5')
+
+    assert_equal ["bar"], tree["children"].map { |n| n["name"] }
+    assert tree["more"]
+  end
+
+  def test_tree_filter_and_time_range
+    assert_equal 2, get('/tree', 'filter' => 'fo+')["total"]
+    assert_equal 2, get('/tree', 'from' => '100', 'to' => '300')["total"]
+  end
+
+  def test_bad_requests
+    server = StackProf::Server.new(StackProf::Report.new(timed_data))
+
+    assert_equal 400, server.call('/tree', 'path' => '9').first
+    assert_equal 400, server.call('/tree', 'filter' => '(').first
+    assert_equal 404, server.call('/nope').first
+  end
+
+  def test_handle
+    server = StackProf::Server.new(StackProf::Report.new(timed_data))
+    client, socket = UNIXSocket.pair
+    client.write "GET /tree?depth=1 HTTP/1.1\r\nHost: localhost\r\n\r\n"
+    server.send(:handle, socket)
+    socket.close
+
+    head, body = client.read.split("\r\n\r\n", 2)
+    lines = head.split("\r\n")
+    assert_equal "HTTP/1.1 200 OK", lines.first
+    assert_includes lines, "Content-Type: application/json"
+    assert_includes lines, "Content-Length: #{body.bytesize}"
+    assert_equal 5, JSON.parse(body)["total"]
+  ensure
+    client.close if client
+  end
+
+  def test_requires_raw
+    assert_raises(ArgumentError) do
+      StackProf::Server.new(StackProf::Report.new(timed_data.reject { |k, _| k == :raw }))
+    end
+  end
+
+  private
+
+  def get(path, params)
+    status, _type, body = StackProf::Server.new(StackProf::Report.new(timed_data)).call(path, params)
+    assert_equal 200, status
+    JSON.parse(body)
+  end
+end
@@ -207,6 +207,367 @@ class StackProfTest < Minitest::Test
     assert_equal 'metadata should be a hash', exception.message
   end
 
+  def test_frame_info_reused_across_results
+    profiles = 2.times.map do
+      StackProf.run(mode: :custom) { StackProf.sample }
+    end
+
+    frames = profiles.map { |profile| profile[:frames].values.find { |f| f[:name].include?("test_frame_info_reused_across_results") } }
+    assert frames.all?
+    assert_predicate frames[0][:name], :frozen?
+    assert_predicate frames[0][:file], :frozen?
+    assert_same frames[0][:name], frames[1][:name]
+    assert_same frames[0][:file], frames[1][:file]
+  end
+
+  def test_thread_states
+    skip "requires thread event hooks" unless RUBY_VERSION >= '3.2'
+
+    profile = StackProf.run(mode: :wall, thread_states: true) do
+      idle
+    end
+
+    states = profile[:thread_states]
+    assert_operator states[:blocked], :>, 0
+    blocked = profile[:frames].values.find { |f| f[:name] == "(blocked)" }
+    assert blocked
+    assert_equal states[:blocked], blocked[:samples]
+  end
+
+  def test_thread_states_raw_timestamps
+    skip "requires thread event hooks" unless RUBY_VERSION >= '3.2'
+
+    # another thread holds the GVL, so samples taken while waiting for it are
+    # repeats, recorded later together with the sample they repeat
+    running = true
+    thread = Thread.new { math while running }
+    profile = StackProf.run(mode: :wall, interval: 1000, thread_states: true, raw: true) do
+      3.times { idle }
+    end
+    running = false
+    thread.join
+
+    timestamps, deltas = profile[:raw_sample_timestamps], profile[:raw_timestamp_deltas]
+    assert_equal timestamps.sort, timestamps
+    repeats = (1...timestamps.size).select { |i| deltas[i] == timestamps[i] - timestamps[i - 1] }
+    assert_operator repeats.size, :>, 1
+    refute_equal [1000], repeats.map { |i| deltas[i] }.uniq, "repeats were spaced by the interval instead of timed"
+  end
+
+  def test_thread_states_gvl_wait
+    skip "requires thread event hooks" unless RUBY_VERSION >= '3.2'
+
+    running = true
+    thread = Thread.new { math while running }
+    profile = StackProf.run(mode: :wall, thread_states: true) do
+      deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.5
+      math while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+    end
+    running = false
+    thread.join
+
+    assert_operator profile[:thread_states][:gvl_wait], :>, 0
+    assert profile[:frames].values.find { |f| f[:name] == "(waiting for GVL)" }
+  end
+
+  def test_thread_states_requires_wall_mode
+    skip "requires thread event hooks" unless RUBY_VERSION >= '3.2'
+
+    assert_raises(ArgumentError) do
+      StackProf.run(mode: :cpu, thread_states: true) {}
+    end
+  end
+
+  def test_thread_states_rejected_with_postponed_jobs
+    skip "requires thread event hooks" unless RUBY_VERSION >= '3.2'
+
+    # use_postponed_job! can't be undone, so it is tried in a separate process
+    script = "StackProf.use_postponed_job!; begin; StackProf.start(thread_states: true); rescue ArgumentError; exit 0; end; exit 1"
+    assert system(RbConfig.ruby, "-I", File.expand_path('../../lib', __FILE__), "-rstackprof", "-e", script)
+  end
+
+  def test_native_frames
+    require 'zlib'
+    data = Random.new(1).bytes(1_000_000)
+    begin
+      profile = StackProf.run(mode: :cpu, interval: 500, native: true) do
+        deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.5
+        while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+          Zlib::Deflate.deflate(data)
+        end
+      end
+    rescue ArgumentError => e
+      skip e.message
+    end
+
+    native = profile[:frames].values.select { |f| f[:native] }
+    refute_empty native
+    assert native.none? { |f| f[:file].empty? }
+  end
+
+  def test_native_frames_require_signal_modes
+    assert_raises(ArgumentError) do
+      StackProf.run(mode: :object, native: true) {}
+    end
+  end
+
+  def test_perf_page_faults
+    begin
+      profile = StackProf.run(mode: :perf, event: :page_faults, interval: 10) do
+        20.times { "x" * 4_000_000 }
+      end
+    rescue ArgumentError, RuntimeError, SystemCallError => e
+      skip e.message
+    end
+
+    assert_equal :perf, profile[:mode]
+    assert_equal :page_faults, profile[:event]
+    assert_operator profile[:samples], :>, 0
+    assert profile[:frames].values.find { |f| f[:name] == "String#*" }
+  end
+
+  def test_perf_task_clock
+    begin
+      profile = StackProf.run(mode: :perf, event: :task_clock, interval: 500) do
+        math
+      end
+    rescue ArgumentError, RuntimeError, SystemCallError => e
+      skip e.message
+    end
+
+    assert_equal :task_clock, profile[:event]
+    assert_operator profile[:samples], :>, 0
+  end
+
+  def test_perf_event_validation
+    assert_raises(ArgumentError) do
+      StackProf.run(mode: :cpu, event: :page_faults) {}
+    end
+    assert_raises(ArgumentError) do
+      StackProf.run(mode: :perf, event: :cache_misses) {}
+    end
+  end
+
+  def recurse(n, &block)
+    n == 0 ? yield : [n].each { recurse(n - 1, &block) }
+  end
+
+  def test_max_depth
+    profile = StackProf.run(mode: :custom, raw: true, max_depth: 5) do
+      recurse(50) { StackProf.sample }
+    end
+
+    raw = profile[:raw]
+    assert_equal 6, raw[0]
+    assert_equal "(truncated)", profile[:frames][raw[1]][:name]
+    assert_equal "StackProf.sample", profile[:frames][raw[6]][:name]
+  end
+
+  def test_max_depth_range
+    assert_raises(ArgumentError) do
+      StackProf.run(mode: :custom, max_depth: 0) {}
+    end
+  end
+
+  def test_fold_recursion
+    profiles = [10, 50].map do |depth|
+      StackProf.run(mode: :custom, raw: true, fold_recursion: true) do
+        recurse(depth) { StackProf.sample }
+      end
+    end
+
+    shallow, deep = profiles.map { |profile| profile[:raw][1, profile[:raw][0]].map { |id| profile[:frames][id][:name] } }
+    assert_equal shallow, deep
+    assert_equal 2, shallow.count("StackProfTest#recurse") # recurse(0) and the folded cycle
+  end
+
+  def test_spill
+    spill = Tempfile.new('stackprof-spill')
+    path = spill.path
+    profiles = [{}, { spill: path, spill_chunk: 100 }].map do |options|
+      StackProf.run(mode: :custom, raw: true, **options) do
+        1000.times do |i|
+          StackProf.with_labels(n: i % 3) { i.even? ? StackProf.sample(i, metric: :bytes) : [1].each { StackProf.sample } }
+        end
+      end
+    end
+    memory, spilled = profiles
+
+    refute File.exist?(path)
+    assert_equal 1000, spilled[:raw_sample_timestamps].size
+    # chunks restart the run-length encoding, so compare sample by sample
+    assert_equal raw_stacks(memory[:raw]), raw_stacks(spilled[:raw])
+    assert_equal raw_stacks(memory[:raw_lines]), raw_stacks(spilled[:raw_lines])
+    assert_equal memory[:raw_sample_label_sets], spilled[:raw_sample_label_sets]
+    assert_equal memory[:raw_sample_weights], spilled[:raw_sample_weights]
+  end
+
+  def raw_stacks(raw)
+    stacks = []
+    i = 0
+    while len = raw[i]
+      stacks.concat([raw[i + 1, len]] * raw[i + len + 1])
+      i += len + 2
+    end
+    stacks
+  end
+
+  def test_spill_requires_raw
+    assert_raises(ArgumentError) do
+      StackProf.run(mode: :custom, spill: Tempfile.new('stackprof-spill').path) {}
+    end
+  end
+
+  def test_with_labels
+    profile = StackProf.run(mode: :custom, raw: true) do
+      StackProf.sample
+      StackProf.with_labels(endpoint: "users#index") do
+        StackProf.sample
+        StackProf.with_labels(db: "main") do
+          2.times { StackProf.sample }
+        end
+      end
+      StackProf.sample
+    end
+
+    assert_equal({ 0 => {}, 1 => { endpoint: "users#index" }, 2 => { endpoint: "users#index", db: "main" } }, profile[:label_sets])
+    assert_equal [0, 1, 2, 2, 0], profile[:raw_sample_label_sets]
+    assert_equal({ 1 => 1, 2 => 2 }, profile[:label_samples])
+  end
+
+  def test_label_sets_are_per_profile
+    3.times do |i|
+      StackProf.run(mode: :custom) { StackProf.with_labels(request: i) { StackProf.sample } }
+    end
+    profile = StackProf.run(mode: :custom) do
+      StackProf.with_labels(request: 3) { StackProf.with_labels(request: 3) { StackProf.sample } }
+      StackProf.with_labels(request: 3) { StackProf.sample }
+      StackProf.with_labels(unused: true) {}
+    end
+
+    assert_equal({ 0 => {}, 1 => { request: 3 } }, profile[:label_sets])
+    assert_equal({ 1 => 2 }, profile[:label_samples])
+  end
+
+  def test_with_labels_when_not_running
+    assert_equal 42, StackProf.with_labels(endpoint: "users#index") { 42 }
+    assert_raises(TypeError) { StackProf.with_labels(nil) {} }
+  end
+
+  def test_with_labels_in_suspended_fiber
+    enum = nil
+    profile = StackProf.run(mode: :custom, raw: true) do
+      enum = Enumerator.new { |y| StackProf.with_labels(endpoint: "enum") { StackProf.sample; y << 1; StackProf.sample; y << 2 } }
+      enum.next
+      StackProf.sample
+      enum.next
+      StackProf.sample
+    end
+
+    assert_equal [1, 0, 1, 0], profile[:raw_sample_label_sets]
+  end
+
+  def test_with_labels_in_collected_fiber
+    # a dangling label set crashed the next GC, so this runs in a separate process
+    script = <<~RUBY
+      def suspend_labeled
+        Enumerator.new { |y| StackProf.with_labels(endpoint: "enum") { y << 1; y << 2 } }.next
+      end
+      StackProf.run(mode: :custom) { suspend_labeled }
+      5.times { GC.start }
+      profile = StackProf.run(mode: :custom) { StackProf.sample }
+      5.times { GC.start }
+      exit(profile[:label_samples] ? 1 : 0)
+    RUBY
+    assert system(RbConfig.ruby, "-I", File.expand_path('../../lib', __FILE__), "-rstackprof", "-e", script, err: File::NULL)
+  end
+
+  def test_weighted_samples
+    profile = StackProf.run(mode: :custom, raw: true) do
+      db_call(5)
+      db_call(7)
+      StackProf.sample(100, metric: "bytes")
+      StackProf.sample
+    end
+
+    assert_equal 4, profile[:samples]
+    assert_equal [:db_ms, :bytes], profile[:metrics]
+    assert_equal({ db_ms: [5, 7, 0, 0], bytes: [0, 0, 100, 0] }, profile[:raw_sample_weights])
+
+    frame = profile[:frames].values.find { |f| f[:name] == "StackProf.sample" }
+    assert_equal 4, frame[:samples]
+    assert_equal({ total_samples: 12, samples: 12 }, frame[:metrics][:db_ms])
+    assert_equal({ total_samples: 100, samples: 100 }, frame[:metrics][:bytes])
+
+    frame = profile[:frames].values.find { |f| f[:name] == "StackProfTest#db_call" }
+    assert_equal 2, frame[:total_samples]
+    assert_equal({ total_samples: 12, samples: 0, edges: frame[:edges].transform_values { 12 }, lines: frame[:lines].transform_values { [12, 0] } },
+                 frame[:metrics][:db_ms])
+  end
+
+  def db_call(ms)
+    StackProf.sample(ms, metric: :db_ms)
+  end
+
+  def test_weighted_samples_validation
+    StackProf.run(mode: :custom) do
+      assert_raises(ArgumentError) { StackProf.sample(-1, metric: :bytes) }
+      assert_raises(ArgumentError) { StackProf.sample(1.5, metric: :bytes) }
+      assert_raises(ArgumentError) { StackProf.sample(1, metric: 1) }
+    end
+    StackProf.run(mode: :cpu) do
+      assert_raises(ArgumentError) { StackProf.sample(1, metric: :bytes) }
+    end
+  end
+
+  def test_gc_compaction
+    skip "GC compaction is not supported" unless GC.respond_to?(:verify_compaction_references)
+
+    profile = StackProf.run(mode: :custom, raw: true) do
+      compaction_target
+      GC.verify_compaction_references(expand_heap: true, toward: :empty)
+      compaction_target
+    end
+
+    frames = profile[:frames].values.select { |f| f[:name] == "StackProfTest#compaction_target" }
+    assert_equal 1, frames.size
+    assert_equal 2, frames.first[:total_samples]
+    assert_empty raw_stacks(profile[:raw]).flatten.uniq - profile[:frames].keys
+  end
+
+  def test_gc_compaction_while_sampling
+    skip "GC compaction is not supported" unless GC.respond_to?(:verify_compaction_references)
+
+    profile = StackProf.run(mode: :cpu, raw: true, interval: 100) do
+      3.times do
+        math
+        GC.verify_compaction_references(expand_heap: true, toward: :empty)
+      end
+    end
+
+    assert_operator profile[:samples], :>, 0
+    assert profile[:frames].values.all? { |f| f[:name].is_a?(String) }
+    assert_empty raw_stacks(profile[:raw]).flatten.uniq - profile[:frames].keys
+  end
+
+  def test_gc_compaction_with_spill
+    skip "GC compaction is not supported" unless GC.respond_to?(:verify_compaction_references)
+
+    spill = Tempfile.new('stackprof-spill')
+    profile = StackProf.run(mode: :custom, raw: true, spill: spill.path, spill_chunk: 1) do
+      compaction_target
+      GC.verify_compaction_references(expand_heap: true, toward: :empty)
+      compaction_target
+    end
+
+    assert_equal 2, profile[:raw_sample_timestamps].size
+    assert_empty raw_stacks(profile[:raw]).flatten.uniq - profile[:frames].keys
+  end
+
+  def compaction_target
+    StackProf.sample
+  end
+
   def test_fork
     StackProf.run do
       pid = fork do
@@ -218,6 +579,107 @@ class StackProfTest < Minitest::Test
     end
   end
 
+  def test_fork_continue
+    skip "requires Process._fork" unless Process.respond_to?(:_fork)
+
+    Dir.mktmpdir do |dir|
+      out = File.join(dir, 'stackprof.dump')
+      pid = nil
+      StackProf.run(mode: :custom, raw: true, out: out, fork: :continue) do
+        StackProf.sample
+        pid = fork do
+          exit! 1 unless StackProf.running?
+          3.times { StackProf.sample }
+        end
+        Process.wait(pid)
+        assert_equal 0, $?.exitstatus
+      end
+
+      child = Marshal.load(File.binread(File.join(dir, "stackprof.#{pid}.dump")))
+      assert_equal 3, child[:samples]
+      assert_equal 3, child[:raw_sample_timestamps].size
+      assert_equal 1, Marshal.load(File.binread(out))[:samples]
+    end
+  end
+
+  def test_fork_continue_with_pathname_or_io
+    skip "requires Process._fork" unless Process.respond_to?(:_fork)
+
+    Dir.mktmpdir do |dir|
+      out = Pathname.new(dir).join('stackprof.dump')
+      pid = nil
+      StackProf.run(mode: :custom, out: out, fork: :continue) do
+        pid = fork { 2.times { StackProf.sample } }
+        Process.wait(pid)
+      end
+      assert_equal 2, Marshal.load(File.binread(File.join(dir, "stackprof.#{pid}.dump")))[:samples]
+
+      File.open(File.join(dir, 'io.dump'), 'wb') do |io|
+        StackProf.run(mode: :custom, out: io, fork: :continue) do
+          StackProf.sample
+          Process.wait(fork { 2.times { StackProf.sample } })
+        end
+      end
+      assert_equal 1, Marshal.load(File.binread(File.join(dir, 'io.dump')))[:samples]
+      assert_equal ["io.dump", "stackprof.#{pid}.dump", "stackprof.dump"], Dir.children(dir).sort
+    end
+  end
+
+  def test_fork_continue_rearms_timer
+    skip "requires Process._fork" unless Process.respond_to?(:_fork)
+
+    Dir.mktmpdir do |dir|
+      pid = nil
+      StackProf.run(mode: :wall, interval: 1000, out: File.join(dir, 'wall.dump'), fork: :continue) do
+        pid = fork do
+          deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.05
+          nil while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+        end
+        Process.wait(pid)
+      end
+
+      child = Marshal.load(File.binread(File.join(dir, "wall.#{pid}.dump")))
+      assert_operator child[:samples], :>, 0
+    end
+  end
+
+  def test_fork_continue_from_other_thread
+    skip "requires thread event hooks" unless RUBY_VERSION >= '3.2'
+
+    Dir.mktmpdir do |dir|
+      pid = nil
+      StackProf.run(mode: :wall, interval: 1000, thread_states: true, out: File.join(dir, 'wall.dump'), fork: :continue) do
+        # the profiled thread is blocked in join while the other one forks
+        Thread.new do
+          pid = fork do
+            deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 0.05
+            nil while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+          end
+        end.join
+        Process.wait(pid)
+      end
+
+      child = Marshal.load(File.binread(File.join(dir, "wall.#{pid}.dump")))
+      assert_operator child[:thread_states][:running], :>, 0
+      assert_equal 0, child[:thread_states][:blocked]
+    end
+  end
+
+  def test_fork_continue_spares_exec_children
+    skip "requires Process._fork" unless Process.respond_to?(:_fork)
+
+    StackProf.run(mode: :wall, interval: 500, fork: :continue) do
+      # an interval timer armed in these children would outlive the exec
+      assert system(RbConfig.ruby, "-e", "sleep 0.1")
+      assert_equal "ok", IO.popen([RbConfig.ruby, "-e", "sleep 0.1; print :ok"], &:read)
+    end
+  end
+
+  def test_fork_option_validation
+    assert_raises(ArgumentError) { StackProf.start(fork: :wait) }
+    refute StackProf.running?
+  end
+
   def foo(n = 10)
     if n == 0
       StackProf.sample
@@ -312,6 +774,20 @@ class StackProfTest < Minitest::Test
     end
   end
 
+  def test_perf_event_interval_is_a_count
+    err = assert_raises(ArgumentError) do
+      StackProf.run(mode: :perf, event: :page_faults, interval: 0) {}
+    end
+    assert_match(/page_faults events/, err.message)
+
+    begin
+      profile = StackProf.run(mode: :perf, event: :page_faults, interval: 2_000_000) {}
+    rescue RuntimeError, SystemCallError => e
+      skip e.message
+    end
+    assert_equal 2_000_000, profile[:interval]
+  end
+
   def math
     250_000.times do
       2 ** 10